@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <cassert> 
+#include <chrono>
+#include <climits>
 #include <stack>
+#include <vector>
 
 #include "c2h5oh.h"
 #include "object_pool.h"
@@ -8,12 +12,138 @@
 //-----------------------------------------------------------------------------
 struct c2h5oh {
   Pq::PqAsync pq;
+  time_t idle_since = 0; // time when connection was freed
+  int    cls = 0;        // priority class of request using connection
+  bool   hedge = false;  // connection of hedge pool
 };
 
 namespace {
 
 object_pool<c2h5oh> pool;
 std::string conn_str;
+time_t max_idle_time = 0;
+bool   session_reset = false; // reset session of freed connections
+size_t   pool_min_size = 0;   // adaptive pool minimal size, 0 - fixed size
+unsigned wait_target   = 0;   // target connection wait time, msec
+double   wait_avg      = 0;   // connection wait time moving average, msec
+const time_t k_shrink_idle_time = 60; // adaptive pool default idle time
+c2h5oh_budget_t * budget = nullptr; // connections budget shared by processes
+int budget_slot = 0;                // process slot in budget
+std::vector<c2h5oh *> draining;     // freed connections with canceled query
+const time_t k_drain_timeout = 10;  // canceled query is dropped after, sec
+
+//-----------------------------------------------------------------------------
+// priority class, connections are given to waiting classes in proportion to 
+// weights (stride scheduling), reserved connections are kept for the class
+struct pool_class {
+  size_t   reserved = 0; // connections not given to other classes
+  unsigned weight   = 1; // connections share while classes wait
+  size_t   used     = 0; // connections in use
+  size_t   waiting  = 0; // requests waiting for connection
+  double   pass     = 0; // virtual time, the least one is served first
+};
+pool_class classes[C2H5OH_MAX_CLASSES];
+double     classes_pass = 0; // virtual time of last served class
+size_t     waiting = 0;      // requests waiting for connection
+
+unsigned shed_target   = 0;  // waiting requests are shed after, msec
+unsigned shed_interval = 0;  // queue delay is measured over, msec
+uint64_t shed_since    = 0;  // current interval start, msec, 0 - queue empty
+unsigned sojourn_min   = UINT_MAX; // least wait of interval served requests
+bool     overloaded    = false;    // least wait of last interval > target
+
+object_pool<c2h5oh> hedge_pool;   // replica connections for hedged queries
+std::string hedge_str;            // replica connection string, empty - none
+
+//-----------------------------------------------------------------------------
+uint64_t now_msec()
+{
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------------------
+// takes connections from shared budget, false if budget is exhausted
+bool budget_acquire(uint64_t n)
+{
+  if (budget == nullptr) {
+    return true;
+  }
+  uint64_t count = __atomic_load_n(&budget->count, __ATOMIC_RELAXED);
+  do {
+    if (count + n > budget->max) {
+      return false;
+    }
+  } while(!__atomic_compare_exchange_n(&budget->count, &count, count + n, 
+                                       true, __ATOMIC_RELAXED, 
+                                       __ATOMIC_RELAXED));
+  __atomic_fetch_add(&budget->used[budget_slot], n, __ATOMIC_RELAXED);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// returns connections to shared budget
+void budget_release(uint64_t n)
+{
+  if (budget != nullptr) {
+    __atomic_fetch_sub(&budget->used[budget_slot], n, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&budget->count, n, __ATOMIC_RELAXED);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// sets pool size limit, grows only while shared budget allows
+bool pool_set_limit(size_t limit)
+{
+  size_t current = pool.get_limit();
+  if (limit > current && !budget_acquire(limit - current)) {
+    return false;
+  }
+  if (limit < current) {
+    budget_release(current - limit);
+  }
+  pool.set_limit(limit);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// free connections left to class after reservations of other classes
+size_t class_free(int cls)
+{
+  size_t used = pool.used_count();
+  size_t free = pool.get_limit() > used ? pool.get_limit() - used : 0;
+  for(int i = 0; i < C2H5OH_MAX_CLASSES && free > 0; i++) {
+    if (i != cls && classes[i].used < classes[i].reserved) {
+      free -= std::min(free, classes[i].reserved - classes[i].used);
+    }
+  }
+  return free;
+}
+
+//-----------------------------------------------------------------------------
+object_pool<c2h5oh> & pool_of(c2h5oh * c)
+{
+  return c->hedge ? hedge_pool : pool;
+}
+
+//-----------------------------------------------------------------------------
+// connects all objects of pool
+void pool_connect(object_pool<c2h5oh> & p, const std::string & str)
+{
+  std::stack<c2h5oh *> v;
+  c2h5oh * c;
+  while((c = p.object_new()) != nullptr) {
+    c->pq.connect(str.c_str(), true);
+    c->idle_since = time(nullptr);
+    c->hedge = &p == &hedge_pool;
+    v.push(c);
+  }
+  while(v.size()) {
+    p.object_delete(v.top());
+    v.pop();
+  }
+}
 
 } // namespace
 
@@ -27,18 +157,38 @@ int c2h5oh_module_init(const char * conn_string, size_t str_len,
 
   conn_str.assign(conn_string, str_len);
 
+  // pool can't be resized while connections are in use
+  if (pool.used_count() != 0) {
+    return -1;
+  }
+
+  // pool size is counted in budget again after resize
+  c2h5oh_budget_t * b = budget;
+  c2h5oh_module_set_budget(nullptr, budget_slot);
   pool.set_max_size(connections_count);
-  
-  std::stack<c2h5oh *> v;
-  c2h5oh * c;
-  while((c = pool.object_new()) != nullptr) {
-    c->pq.connect(conn_str.c_str(), true);
-    v.push(c);
+  if (pool_min_size) {
+    pool.set_limit(pool_min_size);
   }
-  while(v.size()) {
-    pool.object_delete(v.top());
-    v.pop();
+  c2h5oh_module_set_budget(b, budget_slot);
+  wait_avg = 0;
+  pool_connect(pool, conn_str);
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_module_init_hedge(const char * conn_string, size_t str_len, 
+                             uint16_t connections_count)
+{
+  assert(conn_string != NULL);
+  assert(str_len > 0);
+  assert(connections_count > 0);
+
+  if (!hedge_pool.set_max_size(connections_count)) {
+    return -1;
   }
+  hedge_str.assign(conn_string, str_len);
+  pool_connect(hedge_pool, hedge_str);
 
   return 0;
 }
@@ -46,16 +196,241 @@ int c2h5oh_module_init(const char * conn_string, size_t str_len,
 //-----------------------------------------------------------------------------
 void c2h5oh_module_cleanup()
 {
-  c2h5oh * c;
-  while((c = pool.object_new()) != nullptr) {
+  c2h5oh_module_set_budget(nullptr, budget_slot);
+  for(auto c : draining) {
     c->pq.disconnect();
+    pool_of(c).object_delete(c);
   }
+  draining.clear();
+  pool.for_each_free([](c2h5oh & c) {
+    c.pq.disconnect();
+  });
+  hedge_pool.for_each_free([](c2h5oh & c) {
+    c.pq.disconnect();
+  });
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_pool(int policy, time_t idle_time)
+{
+  assert(policy == C2H5OH_POOL_LIFO || policy == C2H5OH_POOL_FIFO);
+
+  pool.set_policy(policy == C2H5OH_POOL_FIFO ? pool_policy::FIFO 
+                                             : pool_policy::LIFO);
+  max_idle_time = idle_time;
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_reset(int reset)
+{
+  session_reset = reset != 0;
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_pool_size(uint16_t min_size, unsigned target_wait)
+{
+  pool_min_size = min_size;
+  wait_target   = target_wait;
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_budget(c2h5oh_budget_t * b, int slot)
+{
+  assert(slot >= 0 && slot < C2H5OH_BUDGET_SLOTS);
+
+  budget_release(pool.get_limit());
+  budget = b;
+  budget_slot = slot;
+  if (budget != nullptr) {
+    // previous process of the slot is gone, its connections are returned
+    uint64_t stale = __atomic_exchange_n(&budget->used[slot], 0, 
+                                         __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&budget->count, stale, __ATOMIC_RELAXED);
+    // pool min size is granted regardless of budget
+    __atomic_fetch_add(&budget->used[slot], pool.get_limit(), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&budget->count, pool.get_limit(), __ATOMIC_RELAXED);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_report_wait(unsigned wait, int waited)
+{
+  if (waited) {
+    sojourn_min = std::min(sojourn_min, wait);
+  }
+  wait_avg += (wait - wait_avg) / 8;
+  if (pool_min_size && wait_avg > wait_target 
+      && pool.get_limit() < pool.get_max_size()
+      && pool_set_limit(pool.get_limit() + 1)) 
+  {
+    // new connection takes time to unload the pool, don't grow again at once
+    wait_avg /= 2;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_maintain(time_t now)
+{
+  time_t idle_time = max_idle_time;
+  if (idle_time == 0 && pool_min_size) {
+    idle_time = k_shrink_idle_time;
+  }
+  if (idle_time == 0) {
+    return;
+  }
+  // connections used recently are busy, adaptive pool keeps min size warm
+  size_t busy = pool.used_count();
+  size_t warm = busy;
+  pool.for_each_free([now, idle_time, &busy, &warm](c2h5oh & c) {
+    if (now - c.idle_since <= idle_time) {
+      busy++;
+      warm += c.pq.is_connected();
+    }
+  });
+  pool.for_each_free([now, idle_time, &warm](c2h5oh & c) {
+    if (now - c.idle_since > idle_time && c.pq.is_connected()) {
+      if (warm < pool_min_size) {
+        warm++;
+        return;
+      }
+      c.pq.disconnect();
+    }
+  });
+  if (pool_min_size && busy < pool.get_limit()) {
+    pool_set_limit(std::max(busy, pool_min_size));
+  }
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_class(int cls, unsigned reserved, unsigned weight)
+{
+  assert(cls >= 0 && cls < C2H5OH_MAX_CLASSES);
+  assert(weight > 0);
+
+  classes[cls].reserved = reserved;
+  classes[cls].weight   = weight;
 }
 
 //-----------------------------------------------------------------------------
 c2h5oh_t * c2h5oh_create()
 {
-  return pool.object_new();
+  return c2h5oh_create_class(0);
+}
+
+//-----------------------------------------------------------------------------
+c2h5oh_t * c2h5oh_create_class(int cls)
+{
+  assert(cls >= 0 && cls < C2H5OH_MAX_CLASSES);
+
+  pool_class & k = classes[cls];
+  if (class_free(cls) == 0) {
+    return nullptr;
+  }
+  // waiting class with less virtual time goes first if it can be served
+  for(int i = 0; i < C2H5OH_MAX_CLASSES; i++) {
+    if (i != cls && classes[i].waiting && classes[i].pass < k.pass 
+        && class_free(i) > 0) 
+    {
+      return nullptr;
+    }
+  }
+  c2h5oh * c = pool.object_new();
+  if (c != nullptr) {
+    c->cls = cls;
+    k.used++;
+    // only connections given while class waits are accounted
+    if (k.waiting) {
+      k.pass += 1.0 / k.weight;
+      classes_pass = k.pass;
+    }
+  }
+  return c;
+}
+
+//-----------------------------------------------------------------------------
+c2h5oh_t * c2h5oh_create_hedge()
+{
+  if (hedge_str.empty()) {
+    return nullptr;
+  }
+  return hedge_pool.object_new();
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_report_latency(c2h5oh_latency_t * l, unsigned latency_ms)
+{
+  assert(l != nullptr);
+  assert(l->percentile > 0 && l->percentile < 100);
+
+  const size_t k = C2H5OH_LATENCY_SAMPLES;
+  l->samples[l->count++ % k] = latency_ms;
+  // percentile is recomputed once per 16 queries after ring is half full
+  if (l->count >= k / 2 && l->count % 16 == 0) {
+    size_t n = std::min(l->count, k);
+    unsigned v[k];
+    std::copy(l->samples, l->samples + n, v);
+    size_t i = n * l->percentile / 100;
+    std::nth_element(v, v + i, v + n);
+    l->delay = std::max(v[i], 1u);
+  }
+}
+
+//-----------------------------------------------------------------------------
+unsigned c2h5oh_hedge_delay(const c2h5oh_latency_t * l)
+{
+  assert(l != nullptr);
+  return hedge_str.empty() ? 0 : l->delay;
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_wait_class(int cls, int wait)
+{
+  assert(cls >= 0 && cls < C2H5OH_MAX_CLASSES);
+
+  pool_class & k = classes[cls];
+  if (wait) {
+    // class starts waiting, it has no credit for the time it was idle
+    if (k.waiting++ == 0) {
+      k.pass = std::max(k.pass, classes_pass);
+    }
+    if (waiting++ == 0) {
+      shed_since  = now_msec();
+      sojourn_min = UINT_MAX;
+    }
+  } else {
+    assert(k.waiting > 0 && waiting > 0);
+    k.waiting--;
+    if (--waiting == 0) {
+      // drained queue is not overloaded
+      shed_since = 0;
+      overloaded = false;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_module_set_shed(unsigned target, unsigned interval)
+{
+  shed_target   = target;
+  shed_interval = interval;
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_shed(unsigned wait)
+{
+  if (shed_target == 0 || wait <= shed_target || shed_since == 0) {
+    return 0;
+  }
+  // queue where even the least waiting served request of interval waited
+  // longer than target is a standing one (CoDel), a burst which is being
+  // drained has short waits; no request served in interval is overload too
+  uint64_t now = now_msec();
+  if (now - shed_since >= shed_interval) {
+    overloaded  = sojourn_min > shed_target;
+    shed_since  = now;
+    sojourn_min = UINT_MAX;
+  }
+  return overloaded;
 }
 
 //-----------------------------------------------------------------------------
@@ -64,8 +439,41 @@ void c2h5oh_free(c2h5oh_t * c)
   //fprintf(stderr, "try to free");
   assert(c != nullptr);
   c->pq.abort();
+  if (session_reset) {
+    c->pq.reset_session();
+  }
   //fprintf(stderr, "connection freed");
-  pool.object_delete(c);
+  c->idle_since = time(nullptr);
+  if (!c->hedge) {
+    classes[c->cls].used--;
+  }
+  if (c->pq.is_busy()) {
+    // returned to pool by c2h5oh_drain when query is canceled
+    draining.push_back(c);
+    return;
+  }
+  pool_of(c).object_delete(c);
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_drain(time_t now)
+{
+  size_t n = 0;
+  for(auto c : draining) {
+    if (c->pq.is_busy()) {
+      c->pq.poll();
+    }
+    if (c->pq.is_busy() && now - c->idle_since > k_drain_timeout) {
+      c->pq.disconnect();
+    }
+    if (c->pq.is_busy()) {
+      draining[n++] = c;
+    } else {
+      pool_of(c).object_delete(c);
+    }
+  }
+  draining.resize(n);
+  return (int)n;
 }
 
 //-----------------------------------------------------------------------------
@@ -75,6 +483,89 @@ int c2h5oh_query(c2h5oh_t * c, const char * query)
   return c->pq.do_query(query) ? 0 : -1;
 }
 
+//-----------------------------------------------------------------------------
+int c2h5oh_query_params(c2h5oh_t * c, const char * query, int nparams, 
+                        const char * const * values, const int * lengths, 
+                        const int * formats)
+{
+  assert(c != nullptr);
+  return c->pq.do_query(query, nparams, values, lengths, formats) ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_query_batch(c2h5oh_t * c, const char * query, int count, 
+                       int nparams, const char * const * values, 
+                       const int * lengths, const int * formats)
+{
+  assert(c != nullptr);
+  return c->pq.do_batch(query, count, nparams, values, lengths, formats, 
+                        true) ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_preamble(c2h5oh_t * c, const char * query, int nparams, 
+                     const char * const * values)
+{
+  assert(c != nullptr);
+  c->pq.set_preamble(query, nparams, values, nullptr);
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_query_copy(c2h5oh_t * c, const char * query, int nparams, 
+                      const char * const * values, const int * lengths, 
+                      const int * formats)
+{
+  assert(c != nullptr);
+  return c->pq.do_copy(query, nparams, values, lengths, formats) ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_is_copy(c2h5oh_t * c)
+{
+  assert(c != nullptr);
+  return c->pq.is_copy() ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_copy_data(c2h5oh_t * c, const char ** data)
+{
+  assert(c != nullptr);
+  assert(data != nullptr);
+  return c->pq.get_copy_data(data);
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_copy_put(c2h5oh_t * c, const char * data, int len)
+{
+  assert(c != nullptr);
+  assert(data != nullptr);
+  return c->pq.put_copy_data(data, len);
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_copy_end(c2h5oh_t * c)
+{
+  assert(c != nullptr);
+  return c->pq.put_copy_end();
+}
+
+//-----------------------------------------------------------------------------
+void c2h5oh_rows(c2h5oh_t * c)
+{
+  assert(c != nullptr);
+  c->pq.set_rows(true);
+}
+
+//-----------------------------------------------------------------------------
+int c2h5oh_query_prepared(c2h5oh_t * c, const char * query, int nparams, 
+                          const char * const * values, const int * lengths, 
+                          const int * formats)
+{
+  assert(c != nullptr);
+  return c->pq.do_query(query, nparams, values, lengths, formats, true) ? 
+    0 : -1;
+}
+
 //-----------------------------------------------------------------------------
 int c2h5oh_poll(c2h5oh_t * c)
 {
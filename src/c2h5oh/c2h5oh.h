@@ -3,6 +3,7 @@
 
 #include <stdint.h> 
 #include <stdlib.h> 
+#include <time.h> 
 
 //-----------------------------------------------------------------------------
 // c2h5oh C interface
@@ -28,11 +29,116 @@ typedef struct c2h5oh c2h5oh_t; // c2h5oh handle
 int c2h5oh_module_init(const char * conn_string, size_t str_len, 
                        uint16_t connections_count);
 
+/**
+ * Init hedge connections pool to database replica, queries slower than 
+ * latency percentile can be repeated on replica, see c2h5oh_hedge_delay
+ * @param conn_string       Replica connection string
+ * @param str_len           Replica connection string length
+ * @param connections_count Hedge connections pool size
+ * @return 0 if succeeded, -1 otherwise
+ */
+int c2h5oh_module_init_hedge(const char * conn_string, size_t str_len, 
+                             uint16_t connections_count);
+
+#define C2H5OH_LATENCY_SAMPLES 256 // recent queries latency ring size
+
+/** Recent queries latency of a route group, drives its hedge delay */
+typedef struct {
+  unsigned samples[C2H5OH_LATENCY_SAMPLES]; // latency ring, msec
+  size_t   count;      // queries reported
+  unsigned percentile; // latency percentile queries are hedged after
+  unsigned delay;      // latency percentile, msec, 0 - unknown
+} c2h5oh_latency_t;
+
 /** 
  * Clean up c2h5oh module 
  */
 void c2h5oh_module_cleanup();
 
+#define C2H5OH_POOL_LIFO 0 // most recently freed connection first
+#define C2H5OH_POOL_FIFO 1 // least recently freed connection first
+
+/**
+ * Set connections pool options
+ * @param policy        free connection selection policy, C2H5OH_POOL_*
+ * @param max_idle_time free connections idle for longer time are 
+ *                      disconnected by c2h5oh_maintain, 0 - never
+ */
+void c2h5oh_module_set_pool(int policy, time_t max_idle_time);
+
+/**
+ * Reset session state (RESET ALL, DISCARD TEMP) of freed connections, reset 
+ * is pipelined with next query on the connection
+ * @param reset 1 - reset session, 0 - keep session state
+ */
+void c2h5oh_module_set_reset(int reset);
+
+/**
+ * Set adaptive connections pool size, has to be called before module init.
+ * Pool starts with min_size connections and grows up to connections_count 
+ * while connection wait time exceeds target_wait, connections idle for 
+ * max_idle_time (60 seconds if not set) are closed down to min_size
+ * @param min_size    minimal pool size, 0 - fixed pool size
+ * @param target_wait target connection wait time, milliseconds
+ */
+void c2h5oh_module_set_pool_size(uint16_t min_size, unsigned target_wait);
+
+#define C2H5OH_BUDGET_SLOTS 1024 // processes sharing budget, NGX_MAX_PROCESSES
+
+/** Connections budget shared by processes, placed in shared memory */
+typedef struct {
+  uint64_t count; // connections pools size of all processes
+  uint64_t max;   // connections count limit
+  uint64_t used[C2H5OH_BUDGET_SLOTS]; // connections pool size of process slot
+} c2h5oh_budget_t;
+
+/**
+ * Set connections budget shared by processes, pool is counted in the budget
+ * and grows over min_size only while budget count is less than max. 
+ * Connections left in the slot by a process died without cleanup are 
+ * returned to the budget, so a slot is used by one process at a time
+ * @param budget shared budget, NULL - no budget
+ * @param slot   process slot, 0..C2H5OH_BUDGET_SLOTS-1
+ */
+void c2h5oh_module_set_budget(c2h5oh_budget_t * budget, int slot);
+
+/**
+ * Report time request waited for free connection, drives adaptive pool size
+ * and load shedding
+ * @param wait   wait time, milliseconds
+ * @param waited 1 - request waited in queue, 0 - connection was free at once;
+ *               only queued requests wait drives load shedding, newcomers 
+ *               taking a connection before waiting ones don't hide overload
+ */
+void c2h5oh_report_wait(unsigned wait, int waited);
+
+#define C2H5OH_MAX_CLASSES 4 // priority classes count
+
+/**
+ * Set priority class admission, class 0 is the default one
+ * @param cls      priority class, 0..C2H5OH_MAX_CLASSES-1
+ * @param reserved connections reserved for the class, other classes don't 
+ *                 get them even if they are free
+ * @param weight   share of connections the class gets while several 
+ *                 classes wait for free connection
+ */
+void c2h5oh_module_set_class(int cls, unsigned reserved, unsigned weight);
+
+/**
+ * Set load shedding of requests waiting for connection, see c2h5oh_shed
+ * @param target   wait time requests are shed after, milliseconds, 0 - off
+ * @param interval interval the least wait time of served requests is 
+ *                 measured over, milliseconds
+ */
+void c2h5oh_module_set_shed(unsigned target, unsigned interval);
+
+/**
+ * Disconnect idle connections, has to be called periodically if 
+ * max_idle_time or min_size is set, connections are reconnected on demand
+ * @param now current time
+ */
+void c2h5oh_maintain(time_t now);
+
 
 //-----------------------------------------------------------------------------
 
@@ -44,11 +150,70 @@ void c2h5oh_module_cleanup();
 c2h5oh_t * c2h5oh_create();
 
 /**
- * Free c2h5oh connection
+ * Get next available c2h5oh connection for priority class request, 
+ * connection is not given if it is reserved for other class or other 
+ * waiting class is to be served first
+ * @param cls priority class
+ * @returns NULL if no connection is available, c2h5oh connection otherwise
+ */
+c2h5oh_t * c2h5oh_create_class(int cls);
+
+/**
+ * Get free connection of hedge pool, it is freed by c2h5oh_free
+ * @returns NULL if no connection is available or no hedge pool
+ */
+c2h5oh_t * c2h5oh_create_hedge();
+
+/**
+ * Report query latency, drives hedge delay
+ * @param l          latency of queries group, percentile is set by caller
+ * @param latency_ms time from sending the query which answered to its 
+ *                   result, milliseconds
+ */
+void c2h5oh_report_latency(c2h5oh_latency_t * l, unsigned latency_ms);
+
+/**
+ * Get delay queries are hedged after, latency percentile of recent queries
+ * @param l latency of queries group
+ * @returns delay in milliseconds, 0 - no hedging (no hedge pool or not 
+ *          enough queries reported)
+ */
+unsigned c2h5oh_hedge_delay(const c2h5oh_latency_t * l);
+
+/**
+ * Mark request of priority class as waiting for connection or done waiting,
+ * waiting classes are served in proportion to weights
+ * @param cls  priority class
+ * @param wait 1 - request starts waiting, 0 - request stops waiting
+ */
+void c2h5oh_wait_class(int cls, int wait);
+
+/**
+ * Check if waiting request has to be shed: wait queue is overloaded (the
+ * least wait time of queued requests served during last shed interval, see 
+ * c2h5oh_report_wait, exceeds shed target, or none were served) and request
+ * waits longer than shed target. Queue is not overloaded when it's empty
+ * @param wait request wait time, milliseconds
+ * @returns 1 if request has to be shed, 0 otherwise
+ */
+int c2h5oh_shed(unsigned wait);
+
+/**
+ * Free c2h5oh connection, query in progress is canceled and connection is
+ * returned to pool by c2h5oh_drain when cancel is done (libpq < 17 can't
+ * cancel without blocking, connection is closed and returned at once)
  * @param c     c2h5oh connection
  */
 void c2h5oh_free(c2h5oh_t * c);
 
+/**
+ * Poll freed connections with canceled query, connections are returned to 
+ * pool when drained or disconnected if cancel takes too long
+ * @param now current time
+ * @returns connections still draining
+ */
+int c2h5oh_drain(time_t now);
+
 
 //-----------------------------------------------------------------------------
 
@@ -60,6 +225,119 @@ void c2h5oh_free(c2h5oh_t * c);
  */ 
 int c2h5oh_query(c2h5oh_t * c, const char * query);
 
+/** 
+ * Perform query with parameters ($1, $2...), parameters are not copied and
+ * have to be valid while query is in progress
+ * @param c       c2h5oh connection
+ * @param query   query to execute, null terminated
+ * @param nparams parameters count
+ * @param values  parameters values, null terminated for text format
+ * @param lengths parameters lengths, used for binary format only
+ * @param formats parameters formats, 0 - text, 1 - binary, NULL for all text
+ * @return Return 0 if succeeded, -1 on error
+ */ 
+int c2h5oh_query_params(c2h5oh_t * c, const char * query, int nparams, 
+                        const char * const * values, const int * lengths, 
+                        const int * formats);
+
+/**
+ * Send prepared query for each of count parameters sets in one round trip,
+ * each query is executed in own transaction. Result is json array of query
+ * results, query error is {"status":500,"error":"..."} item
+ * @param c       c2h5oh connection
+ * @param query   query text
+ * @param count   parameters sets count
+ * @param nparams parameters count of each query
+ * @param values  count * nparams parameters, see c2h5oh_query_params
+ * @param lengths count * nparams parameters lengths, NULL for text
+ * @param formats count * nparams parameters formats, NULL for text
+ * @return 0 if query is sent, -1 otherwise
+ */
+int c2h5oh_query_batch(c2h5oh_t * c, const char * query, int count, 
+                       int nparams, const char * const * values, 
+                       const int * lengths, const int * formats);
+
+/**
+ * Perform COPY query, COPY has no bind parameters: $1..$nparams in query 
+ * text are replaced with quoted literals of parameters. Poll completes when 
+ * copy is started (c2h5oh_is_copy) or with an error
+ * @param c       c2h5oh connection
+ * @param query   COPY query text
+ * @param nparams parameters count
+ * @param values  parameters, text or binary of given length
+ * @param lengths binary parameters length
+ * @param formats parameters format, 0 - text, 1 - binary
+ * @return 0 if succeeded, -1 otherwise
+ */
+int c2h5oh_query_copy(c2h5oh_t * c, const char * query, int nparams, 
+                      const char * const * values, const int * lengths, 
+                      const int * formats);
+
+/**
+ * Check for COPY is started by completed query
+ * @param c       c2h5oh connection
+ * @return 1 if copy data is transferred, 0 otherwise
+ */
+int c2h5oh_is_copy(c2h5oh_t * c);
+
+/**
+ * Read COPY TO STDOUT data row without blocking
+ * @param c       c2h5oh connection
+ * @param data    row data, valid until next call
+ * @return row length, 0 - no data available yet, -1 - copy is done, poll 
+ *         completes with COPY command result (error if copy is failed)
+ */
+int c2h5oh_copy_data(c2h5oh_t * c, const char ** data);
+
+/**
+ * Send COPY FROM STDIN data without blocking, data is not sent until 
+ * previous data is flushed to database
+ * @param c       c2h5oh connection
+ * @param data    copy data, it is copied
+ * @param len     data length
+ * @return 1 - data is queued, 0 - previous data is not sent yet, retry 
+ *         later, -1 - copy is failed, poll completes with the error
+ */
+int c2h5oh_copy_put(c2h5oh_t * c, const char * data, int len);
+
+/**
+ * Finish COPY FROM STDIN without blocking
+ * @param c       c2h5oh connection
+ * @return 1 - poll completes with COPY command result, 0 - retry later,
+ *         -1 - poll completes with the error
+ */
+int c2h5oh_copy_end(c2h5oh_t * c);
+
+/**
+ * Return all rows of next queries as json array of objects with column 
+ * names as keys: numbers, booleans, json and null values are not quoted, 
+ * other types are json strings. Cleared by c2h5oh_free
+ * @param c       c2h5oh connection
+ */
+void c2h5oh_rows(c2h5oh_t * c);
+
+/**
+ * Set statement executed before next query in the same transaction and 
+ * round trip, e.g. set_config(name, value, true) request context. Preamble
+ * error is returned as query error, preamble is cleared by c2h5oh_free
+ * @param c       c2h5oh connection
+ * @param query   preamble statement
+ * @param nparams parameters count
+ * @param values  text parameters, have to be valid while query is in progress
+ */
+void c2h5oh_preamble(c2h5oh_t * c, const char * query, int nparams, 
+                     const char * const * values);
+
+/** 
+ * Perform query with parameters as prepared statement, statement is prepared
+ * once per connection on first use, arguments are the same as for 
+ * c2h5oh_query_params
+ * @return Return 0 if succeeded, -1 on error
+ */ 
+int c2h5oh_query_prepared(c2h5oh_t * c, const char * query, int nparams, 
+                          const char * const * values, const int * lengths, 
+                          const int * formats);
+
 /**
  * Poll c2h5oh connection, client must call it while result is ready
  * @param  c c2h5oh connection
@@ -85,6 +363,83 @@ size_t       c2h5oh_result_len(c2h5oh_t * c);
 /** Returns 0 if result is not error */
 int c2h5oh_is_error(c2h5oh_t * c);
 
+//-----------------------------------------------------------------------------
+// urlencoded args to json
+
+/**
+ * Returns max length of json produced by c2h5oh_args_json
+ * @param start urlencoded args start
+ * @param end   urlencoded args end
+ */
+size_t c2h5oh_args_json_len(const char * start, const char * end);
+
+/**
+ * Converts urlencoded args to json object members "key":"value", values are
+ * url-decoded, control characters, quotes and backslashes are json-escaped
+ * @param dst     destination, at least c2h5oh_args_json_len bytes
+ * @param start   urlencoded args start
+ * @param end     urlencoded args end
+ * @param members json object members start, comma is added if dst != members
+ * @return end of written json, NULL on wrong escape sequence
+ */
+char * c2h5oh_args_json(char * dst, const char * start, const char * end,
+                        const char * members);
+
+//-----------------------------------------------------------------------------
+// response cache, per process
+
+struct c2h5oh_cache_entry; // cache entry forward declaration
+typedef struct c2h5oh_cache_entry c2h5oh_cache_entry_t; // cache entry handle
+
+/**
+ * Init response cache, least recently used entries are removed if cache 
+ * size exceeds max_size
+ * @param max_size   cache size in bytes, 0 to disable cache
+ * @param gzip_level gzip compression level, 1..9
+ */
+void c2h5oh_cache_init(size_t max_size, int gzip_level);
+
+/**
+ * Find cache entry, expired entry is removed
+ * @param key     cache key
+ * @param key_len cache key length
+ * @param now     current time
+ * @return NULL if not found, entry is valid until next c2h5oh_cache_put
+ */
+c2h5oh_cache_entry_t * c2h5oh_cache_get(const char * key, size_t key_len,
+                                        time_t now);
+
+/**
+ * Store result in cache
+ * @param key        cache key
+ * @param key_len    cache key length
+ * @param result     query result
+ * @param result_len query result length
+ * @param expires    expiration time
+ * @return NULL if result doesn't fit in cache, cache entry otherwise
+ */
+c2h5oh_cache_entry_t * c2h5oh_cache_put(const char * key, size_t key_len,
+                                        const char * result, size_t result_len,
+                                        time_t expires);
+
+/**
+ * Returns cached query result
+ * @param e   cache entry
+ * @param len result length
+ */
+const char * c2h5oh_cache_result(c2h5oh_cache_entry_t * e, size_t * len);
+
+/**
+ * Returns gzip compressed content, content is compressed on first call only
+ * @param e           cache entry
+ * @param content     response content of cached result
+ * @param content_len response content length
+ * @param len         compressed content length
+ * @return NULL if content is not compressible
+ */
+const char * c2h5oh_cache_gzip(c2h5oh_cache_entry_t * e, const char * content,
+                               size_t content_len, size_t * len);
+
 //-----------------------------------------------------------------------------
 
 #ifdef __cplusplus
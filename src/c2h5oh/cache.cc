@@ -0,0 +1,180 @@
+#include <cassert>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <zlib.h>
+
+#include "c2h5oh.h"
+
+//-----------------------------------------------------------------------------
+struct c2h5oh_cache_entry {
+  std::string result;     // query result
+  std::string gzip;       // gzip compressed content, empty if not compressed
+  bool        gzip_done;  // content compression was tried
+  time_t      expires;    // expiration time
+  std::list<std::string_view>::iterator lru; // position in lru list
+};
+
+namespace {
+
+//-----------------------------------------------------------------------------
+struct KeyHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>()(s);
+  }
+};
+
+typedef std::unordered_map<std::string, c2h5oh_cache_entry, KeyHash,
+                           std::equal_to<>> CacheMap;
+
+CacheMap                    cache;         // key -> entry
+std::list<std::string_view> cache_lru;     // keys, most recently used first
+size_t                      cache_size = 0;
+size_t                      cache_max_size = 0;
+int                         cache_gzip_level = Z_DEFAULT_COMPRESSION;
+
+//-----------------------------------------------------------------------------
+size_t entry_size(const CacheMap::value_type & e)
+{
+  return e.first.size() + e.second.result.size() + e.second.gzip.size();
+}
+
+//-----------------------------------------------------------------------------
+void entry_erase(CacheMap::iterator it)
+{
+  cache_size -= entry_size(*it);
+  cache_lru.erase(it->second.lru);
+  cache.erase(it);
+}
+
+//-----------------------------------------------------------------------------
+// removes least recently used entries until size fits
+void cache_shrink(size_t size)
+{
+  while(cache_size + size > cache_max_size && !cache_lru.empty()) {
+    entry_erase(cache.find(cache_lru.back()));
+  }
+}
+
+//-----------------------------------------------------------------------------
+// gzip compression, false if compressed data is not smaller than source
+bool gzip(const char * src, size_t len, int level, std::string & dst)
+{
+  z_stream z = {};
+  if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+      != Z_OK)
+  {
+    return false;
+  }
+  dst.resize(deflateBound(&z, len));
+  z.next_in   = (Bytef *)src;
+  z.avail_in  = len;
+  z.next_out  = (Bytef *)dst.data();
+  z.avail_out = dst.size();
+  int rc = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+  if (rc != Z_STREAM_END || z.total_out >= len) {
+    dst.clear();
+    return false;
+  }
+  dst.resize(z.total_out);
+  dst.shrink_to_fit();
+  return true;
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+void c2h5oh_cache_init(size_t max_size, int gzip_level)
+{
+  assert(gzip_level >= 1 && gzip_level <= 9);
+
+  cache_max_size   = max_size;
+  cache_gzip_level = gzip_level;
+  cache_shrink(0);
+}
+
+//-----------------------------------------------------------------------------
+c2h5oh_cache_entry_t * c2h5oh_cache_get(const char * key, size_t key_len,
+                                        time_t now)
+{
+  assert(key != nullptr);
+
+  auto it = cache.find(std::string_view(key, key_len));
+  if (it == cache.end()) {
+    return nullptr;
+  }
+  if (it->second.expires <= now) {
+    entry_erase(it);
+    return nullptr;
+  }
+  cache_lru.splice(cache_lru.begin(), cache_lru, it->second.lru);
+  return &it->second;
+}
+
+//-----------------------------------------------------------------------------
+c2h5oh_cache_entry_t * c2h5oh_cache_put(const char * key, size_t key_len,
+                                        const char * result, size_t result_len,
+                                        time_t expires)
+{
+  assert(key != nullptr);
+  assert(result != nullptr);
+
+  if (key_len + result_len > cache_max_size) {
+    return nullptr;
+  }
+
+  auto it = cache.find(std::string_view(key, key_len));
+  if (it != cache.end()) {
+    entry_erase(it);
+  }
+  cache_shrink(key_len + result_len);
+
+  it = cache.emplace(std::string(key, key_len), c2h5oh_cache_entry()).first;
+  c2h5oh_cache_entry & e = it->second;
+  e.result.assign(result, result_len);
+  e.gzip_done = false;
+  e.expires   = expires;
+  cache_lru.push_front(it->first);
+  e.lru = cache_lru.begin();
+  cache_size += entry_size(*it);
+
+  return &e;
+}
+
+//-----------------------------------------------------------------------------
+const char * c2h5oh_cache_result(c2h5oh_cache_entry_t * e, size_t * len)
+{
+  assert(e != nullptr);
+
+  *len = e->result.size();
+  return e->result.data();
+}
+
+//-----------------------------------------------------------------------------
+const char * c2h5oh_cache_gzip(c2h5oh_cache_entry_t * e, const char * content,
+                               size_t content_len, size_t * len)
+{
+  assert(e != nullptr);
+
+  if (!e->gzip_done) {
+    // compressed once, entry may be evicted if it doesn't fit anymore
+    e->gzip_done = true;
+    if (gzip(content, content_len, cache_gzip_level, e->gzip)) {
+      cache_size += e->gzip.size();
+      if (cache_size > cache_max_size) {
+        cache_size -= e->gzip.size();
+        e->gzip.clear();
+        e->gzip.shrink_to_fit();
+      }
+    }
+  }
+  if (e->gzip.empty()) {
+    return nullptr;
+  }
+  *len = e->gzip.size();
+  return e->gzip.data();
+}
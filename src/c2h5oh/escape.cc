@@ -0,0 +1,221 @@
+#include <cassert>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif//__SSE2__
+
+#include "c2h5oh.h"
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// bytes which can't be copied as is: separators, escapes, json specials and
+// control characters
+struct SpecialTable {
+  bool v[256];
+  constexpr SpecialTable() : v() {
+    for (int i = 0; i < 0x20; i++) v[i] = true;
+    v[(unsigned char)'='] = v[(unsigned char)'&'] = true;
+    v[(unsigned char)'%'] = v[(unsigned char)'+'] = true;
+    v[(unsigned char)'"'] = v[(unsigned char)'\\'] = true;
+  }
+};
+constexpr SpecialTable kSpecial;
+
+//-----------------------------------------------------------------------------
+// returns first special byte in [p, end), end if there is no one
+inline const char * skip_plain(const char * p, const char * end)
+{
+#ifdef __AVX2__
+  const __m256i eq32  = _mm256_set1_epi8('=');
+  const __m256i amp32 = _mm256_set1_epi8('&');
+  const __m256i pct32 = _mm256_set1_epi8('%');
+  const __m256i pls32 = _mm256_set1_epi8('+');
+  const __m256i dq32  = _mm256_set1_epi8('"');
+  const __m256i bs32  = _mm256_set1_epi8('\\');
+  const __m256i ctl32 = _mm256_set1_epi8(0x1f);
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, eq32),
+                                _mm256_cmpeq_epi8(v, amp32));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, pct32));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, pls32));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, dq32));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bs32));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl32), v));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+#endif//__AVX2__
+#ifdef __SSE2__
+  const __m128i eq  = _mm_set1_epi8('=');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i pct = _mm_set1_epi8('%');
+  const __m128i pls = _mm_set1_epi8('+');
+  const __m128i dq  = _mm_set1_epi8('"');
+  const __m128i bs  = _mm_set1_epi8('\\');
+  const __m128i ctl = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, eq), _mm_cmpeq_epi8(v, amp));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, pct));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, pls));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dq));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bs));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v)); // v <= 0x1f
+    unsigned mask = (unsigned)_mm_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif//__SSE2__
+  while (p < end && !kSpecial.v[(unsigned char)*p]) p++;
+  return p;
+}
+
+//-----------------------------------------------------------------------------
+// writes json escaped byte
+inline char * escape_byte(char * p, unsigned char c)
+{
+  static const char hex[] = "0123456789abcdef";
+  switch(c) {
+    case '"'  : *p++ = '\\'; *p++ = '"';  break;
+    case '\\' : *p++ = '\\'; *p++ = '\\'; break;
+    case '\b' : *p++ = '\\'; *p++ = 'b';  break;
+    case '\f' : *p++ = '\\'; *p++ = 'f';  break;
+    case '\n' : *p++ = '\\'; *p++ = 'n';  break;
+    case '\r' : *p++ = '\\'; *p++ = 'r';  break;
+    case '\t' : *p++ = '\\'; *p++ = 't';  break;
+    default:
+      if (c < 0x20) {
+        *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
+        *p++ = hex[c >> 4]; *p++ = hex[c & 0x0f];
+      } else {
+        *p++ = c;
+      }
+  }
+  return p;
+}
+
+//-----------------------------------------------------------------------------
+// returns hex digit value, -1 if c is not a hex digit
+inline int hex_value(unsigned char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+// copies key until '=' or '&', nothing is decoded
+inline char * copy_key(char * p, const char ** src, const char * end)
+{
+  const char * s = *src;
+  for(;;) {
+    const char * plain = skip_plain(s, end);
+    memcpy(p, s, plain - s);
+    p += plain - s;
+    s = plain;
+    if (s == end || *s == '=' || *s == '&') {
+      break;
+    }
+    p = escape_byte(p, *s++);
+  }
+  *src = s;
+  return p;
+}
+
+//-----------------------------------------------------------------------------
+// copies value until '=' or '&' decoding %XX and '+', NULL on wrong escape
+inline char * copy_value(char * p, const char ** src, const char * end)
+{
+  const char * s = *src;
+  for(;;) {
+    const char * plain = skip_plain(s, end);
+    memcpy(p, s, plain - s);
+    p += plain - s;
+    s = plain;
+    if (s == end || *s == '=' || *s == '&') {
+      break;
+    }
+    if (*s == '%') {
+      if (end - s < 3) {
+        return nullptr;
+      }
+      int hi = hex_value(s[1]);
+      int lo = hex_value(s[2]);
+      if (hi < 0 || lo < 0) {
+        return nullptr;
+      }
+      p = escape_byte(p, (unsigned char)((hi << 4) | lo));
+      s += 3;
+    } else if (*s == '+') {
+      *p++ = ' ';
+      s++;
+    } else {
+      p = escape_byte(p, *s++);
+    }
+  }
+  *src = s;
+  return p;
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+size_t c2h5oh_args_json_len(const char * start, const char * end)
+{
+  assert(start <= end);
+
+  size_t len = sizeof(",\"\":\"\"") - 1;
+  const char * p = start;
+  while((p = skip_plain(p, end)) < end) {
+    switch(*p) {
+      case '=' :
+      case '&' : len += sizeof(",\"\":\"\"") - 2; break; // new member
+      case '%' : len += sizeof("\\u00XX") - 2;    break; // 3 bytes -> 6
+      case '+' :                                  break;
+      case '"' :
+      case '\\': len += 1;                        break;
+      default  : len += sizeof("\\u00XX") - 2;    break; // control
+    }
+    p++;
+  }
+  return len + (end - start);
+}
+
+//-----------------------------------------------------------------------------
+char * c2h5oh_args_json(char * dst, const char * start, const char * end,
+                        const char * members)
+{
+  assert(dst != nullptr);
+  assert(start <= end);
+
+  char * p = dst;
+  while(start < end) {
+    if (p != members) {
+      *p++ = ',';
+    }
+    *p++ = '"';
+    while(start < end && (*start == '=' || *start == '&')) start++;
+    p = copy_key(p, &start, end);
+    *p++ = '"'; *p++ = ':'; *p++ = '"';
+    if (start < end && *start == '=') {
+      start++;
+      p = copy_value(p, &start, end);
+      if (p == nullptr) {
+        return nullptr;
+      }
+    } else if (start < end) {
+      start++;
+    }
+    *p++ = '"';
+  }
+  return p;
+}
@@ -1,40 +1,135 @@
 #pragma once
-#include <list>
-#include <stack>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
 
+//-----------------------------------------------------------------------------
+/** Free object selection policy */
+enum class pool_policy {
+  LIFO, // most recently freed object first, keeps few objects warm
+  FIFO  // least recently freed object first, spreads load evenly
+};
+
+//-----------------------------------------------------------------------------
+/**
+ * Fixed size objects pool, objects are constructed in contiguous cache line
+ * aligned array by set_max_size, free objects are linked in intrusive list,
+ * object_new and object_delete don't allocate memory
+ */
 template <class TYPE>
 class object_pool
 {
 public:
-  TYPE * object_new() {          // returns new object
-    if(free_objects.empty()) {
-      if (pool.size() >= max_size) {
-        return nullptr;
-      } else {
-        pool.emplace_back();
-        TYPE & res = pool.back();
-        return &res;
+  TYPE * object_new() {          // returns free object, nullptr if no one
+    slot * s = free_head;
+    if (s == nullptr || used >= limit) {
+      return nullptr;
+    }
+    free_head = s->next;
+    if (free_head == nullptr) {
+      free_tail = nullptr;
+    }
+    s->next = nullptr;
+    used++;
+#ifdef _DEBUG
+    assert(!s->in_use);
+    s->in_use = true;
+#endif//_DEBUG
+    return &s->object;
+  }
+  void object_delete(TYPE * o) { // returns object - mark as unused
+    slot * s = slot_of(o);
+#ifdef _DEBUG
+    assert(s->in_use && "object_pool: double free");
+    s->in_use = false;
+#endif//_DEBUG
+    if (policy == pool_policy::LIFO || free_head == nullptr) {
+      s->next = free_head;
+      free_head = s;
+      if (free_tail == nullptr) {
+        free_tail = s;
       }
     } else {
-      TYPE * res = free_objects.top(); 
-      free_objects.pop();
-      return res;
+      s->next = nullptr;
+      free_tail->next = s;
+      free_tail = s;
     }
+    used--;
   }
-  void object_delete(TYPE * o) { // returns object - mark as unused
-    free_objects.push(o);
+
+  /** Calls f for each free object in selection order */
+  template <class F> void for_each_free(F f) {
+    for(slot * s = free_head; s != nullptr; s = s->next) {
+      f(s->object);
+    }
   }
 
-  void set_max_size(size_t size) { max_size = size; }
+  /** Reallocates pool, false if some objects are in use */
+  bool set_max_size(size_t size) {
+    if (used != 0) {
+      return false;
+    }
+    slots.reset();
+    free_head = nullptr;
+    free_tail = nullptr;
+    max_size = 0;
+    limit    = size;
+    if (size > 0) {
+      slots.reset(new slot[size]);
+      max_size = size;
+      // first object is returned first
+      for(size_t i = size; i > 0; i--) {
+        slots[i - 1].next = free_head;
+        free_head = &slots[i - 1];
+      }
+      free_tail = &slots[size - 1];
+    }
+    return true;
+  }
+  void set_policy(pool_policy p) { policy = p; }   // selection policy
+  /** Limits objects in use, objects over limit stay free until it grows */
+  void set_limit(size_t l) { limit = l < max_size ? l : max_size; }
+  size_t get_limit() const { return limit; }       // objects in use limit
+  size_t get_max_size() const { return max_size; } // pool size
+  size_t used_count() const { return used; }       // objects in use
 
-  object_pool() : max_size(10) {} // default constructor
-  virtual ~object_pool() {}       // virtual destructor
+  object_pool()                  // constructor, empty until set_max_size
+    : max_size(0), limit(0), used(0), policy(pool_policy::LIFO)
+    , free_head(nullptr), free_tail(nullptr) 
+  {
+  }
+  virtual ~object_pool() {       // virtual destructor
+#ifdef _DEBUG
+    if (used != 0) {
+      fprintf(stderr, "object_pool: %zu objects leaked\n", used);
+    }
+#endif//_DEBUG
+  }
 
-private: 
+private:
   object_pool(const object_pool&) = delete;    // disallow assign
   void operator=(const object_pool&) = delete; // disallow copy
+
+  struct alignas(64) slot {      // object with free list link
+    TYPE   object;
+    slot * next   = nullptr;
+#ifdef _DEBUG
+    bool   in_use = false;
+#endif//_DEBUG
+  };
+
+  slot * slot_of(TYPE * o) {     // slot of pool object
+    size_t i = ((char *)o - (char *)slots.get()) / sizeof(slot);
+    assert(i < max_size && &slots[i].object == o);
+    return &slots[i];
+  }
+
   size_t max_size;
-  std::list<TYPE>    pool;           // objects list
-  std::stack<TYPE *> free_objects;   // free objects stack
+  size_t limit;
+  size_t used;
+  pool_policy policy;
+  slot * free_head;                  // free objects list, next to select
+  slot * free_tail;                  // free objects list tail
+  std::unique_ptr<slot[]> slots;     // objects array
 };
-
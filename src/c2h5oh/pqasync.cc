@@ -1,17 +1,113 @@
 #include <libpq-fe.h>
 #include <cassert>
+#include <cctype>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
 #include <string.h>
 
 #include "pqasync.h"
 
 namespace Pq {
 
+//-----------------------------------------------------------------------------
+// DISCARD ALL drops prepared statements and can't run in pipeline
+const char * k_reset_statements[] = { "RESET ALL", "DISCARD TEMP" };
+const char * k_reset_query = "RESET ALL; DISCARD TEMP";
+
+namespace {
+
+//-----------------------------------------------------------------------------
+bool is_ident_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '$' || (c & 0x80);
+}
+
+//-----------------------------------------------------------------------------
+// returns end of string literal, quoted identifier, dollar-quoted string or
+// comment starting at s, s if there is no one, unterminated one lasts to end
+const char * sql_skip(const char * begin, const char * s)
+{
+  const char * p = s + 1;
+  switch(*s) {
+    case '\'':
+    case '"': {
+      // E'' strings have backslash escapes, quotes are escaped by doubling
+      bool esc = *s == '\'' && s > begin && (s[-1] == 'E' || s[-1] == 'e') &&
+                 (s - 1 == begin || !is_ident_char(s[-2]));
+      for(; *p; p++) {
+        if (esc && *p == '\\' && p[1]) {
+          p++;
+        } else if (*p == *s) {
+          if (p[1] != *s) {
+            return p + 1;
+          }
+          p++;
+        }
+      }
+      return p;
+    }
+    case '-':
+      if (*p != '-') {
+        return s;
+      }
+      while(*p && *p != '\n') p++;
+      return p;
+    case '/': {
+      if (*p != '*') {
+        return s;
+      }
+      // block comments are nested
+      int depth = 1;
+      for(p++; *p && depth; p++) {
+        if (p[0] == '/' && p[1] == '*') {
+          depth++; p++;
+        } else if (p[0] == '*' && p[1] == '/') {
+          depth--; p++;
+        }
+      }
+      return p;
+    }
+    case '$': {
+      // $tag$...$tag$, tag is identifier without $, $n is parameter
+      if (s > begin && is_ident_char(s[-1])) {
+        return s;
+      }
+      if (*p != '$' && !isalpha((unsigned char)*p) && *p != '_' && 
+          !(*p & 0x80)) 
+      {
+        return s;
+      }
+      while(*p != '$' && *p && is_ident_char(*p)) p++;
+      if (*p != '$') {
+        return s;
+      }
+      std::string_view tag(s, p + 1 - s);
+      const char * end = strstr(p + 1, std::string(tag).c_str());
+      return end ? end + tag.size() : p + strlen(p);
+    }
+  }
+  return s;
+}
+
+} // namespace
+
 //-----------------------------------------------------------------------------
 struct Pg {
-  Pg() : conn(nullptr), cancel(nullptr) {}
+  Pg() : conn(nullptr) {}
   PGconn * conn;
-  PGcancel * cancel;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  PGcancelConn * cancel_conn = nullptr; // non-blocking cancel request
+#endif//LIBPQ_HAS_ASYNC_CANCEL
+
+  void free_cancel() {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    if (cancel_conn) {
+      PQcancelFinish(cancel_conn);
+      cancel_conn = nullptr;
+    }
+#endif//LIBPQ_HAS_ASYNC_CANCEL
+  }
 };
 
 //-----------------------------------------------------------------------------
@@ -19,6 +115,22 @@ PqAsync::PqAsync()
   : pg(new Pg())
   , conn_string_(nullptr)
   , query_(nullptr)
+  , nparams_(0)
+  , param_values_(nullptr)
+  , param_lengths_(nullptr)
+  , param_formats_(nullptr)
+  , prepared_(false)
+  , statement_id_(0)
+  , reset_pending_(false)
+  , syncs_(0)
+  , batch_count_(0)
+  , preamble_(nullptr)
+  , preamble_nparams_(0)
+  , preamble_values_(nullptr)
+  , preamble_lengths_(nullptr)
+  , rows_(false)
+  , copy_(false)
+  , copy_buf_(nullptr)
   , state(PqState::START)
 {}
 
@@ -35,14 +147,16 @@ void PqAsync::disconnect()
     if (state == PqState::QUERY) {
       cancel_query(false);
     }
-    if (pg->cancel) {
-      PQfreeCancel(pg->cancel);
-      pg->cancel = nullptr;
-    }
+    pg->free_cancel();
+    free_copy_buf();
     state = PqState::START;
     PQfinish(pg->conn);
     pg->conn = nullptr;
-    pg->cancel = nullptr;
+    statements_.clear();
+    preparing_.clear();
+    reset_pending_ = false;
+    pending_.clear();
+    syncs_ = 0;
   }
 }
 
@@ -82,13 +196,35 @@ bool PqAsync::connect(const char * conn_string, bool non_blocking)
 
 //-----------------------------------------------------------------------------
 bool PqAsync::do_query(const char * query)
+{
+  return do_query(query, 0, nullptr, nullptr, nullptr);
+}
+
+//-----------------------------------------------------------------------------
+bool PqAsync::do_query(const char * query, int nparams, 
+                       const char * const * values, const int * lengths, 
+                       const int * formats, bool prepared)
 {
   assert(query);
+  assert(nparams == 0 || values);
+
+  nparams_       = nparams;
+  param_values_  = values;
+  param_lengths_ = lengths;
+  param_formats_ = formats;
+  prepared_      = prepared;
+  batch_count_   = 0;
+  copy_          = false;
 
   if (state == PqState::RESULT) {
     state = PqState::CONNECTED;
   }
 
+  if (state == PqState::COPY) {
+    // copy can't be canceled, connection is dropped
+    disconnect();
+  }
+
   if (state == PqState::QUERY) {
     cancel_query();
     query_ = query;
@@ -99,9 +235,115 @@ bool PqAsync::do_query(const char * query)
   return true;
 }
 
+//-----------------------------------------------------------------------------
+bool PqAsync::do_batch(const char * query, int count, int nparams, 
+                       const char * const * values, const int * lengths, 
+                       const int * formats, bool prepared)
+{
+  assert(count > 0);
+
+  do_query(query, nparams, values, lengths, formats, prepared);
+  batch_count_ = count;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void PqAsync::set_preamble(const char * query, int nparams, 
+                           const char * const * values, const int * lengths)
+{
+  assert(query);
+  assert(nparams == 0 || values);
+
+  preamble_         = query;
+  preamble_nparams_ = nparams;
+  preamble_values_  = values;
+  preamble_lengths_ = lengths;
+}
+
+//-----------------------------------------------------------------------------
+bool PqAsync::do_copy(const char * query, int nparams, 
+                      const char * const * values, const int * lengths, 
+                      const int * formats)
+{
+  do_query(query, nparams, values, lengths, formats);
+  copy_ = true;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+int PqAsync::get_copy_data(const char ** data)
+{
+  assert(state == PqState::COPY);
+
+  free_copy_buf();
+  if (PQconsumeInput(pg->conn) == 0) {
+    // copy is failed, error is returned as result
+    state = PqState::QUERY;
+    return -1;
+  }
+  int len = PQgetCopyData(pg->conn, &copy_buf_, 1);
+  if (len > 0) {
+    *data = copy_buf_;
+    return len;
+  }
+  if (len < 0) {
+    // copy is done or failed, COPY command result follows
+    state = PqState::QUERY;
+    return -1;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+int PqAsync::put_copy_data(const char * data, int len)
+{
+  assert(state == PqState::COPY);
+
+  // one chunk is queued at a time, libpq buffer doesn't grow with body
+  int rc = PQflush(pg->conn);
+  if (rc == 1) {
+    return 0;
+  }
+  if (rc == 0) {
+    rc = PQputCopyData(pg->conn, data, len);
+  }
+  if (rc < 0) {
+    state = PqState::QUERY;
+    return -1;
+  }
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+int PqAsync::put_copy_end()
+{
+  assert(state == PqState::COPY);
+
+  int rc = PQputCopyEnd(pg->conn, nullptr);
+  if (rc != 0) {
+    state = PqState::QUERY;
+  }
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+void PqAsync::free_copy_buf()
+{
+  if (copy_buf_ != nullptr) {
+    PQfreemem(copy_buf_);
+    copy_buf_ = nullptr;
+  }
+}
+
 //-----------------------------------------------------------------------------
 void PqAsync::abort()
 {
+  preamble_ = nullptr;
+  rows_     = false;
+  if (state == PqState::COPY) {
+    // copy can't be canceled, connection is dropped
+    disconnect();
+  }
   if (state == PqState::QUERY) {
     cancel_query(false);
   }
@@ -110,25 +352,24 @@ void PqAsync::abort()
 //-----------------------------------------------------------------------------
 void PqAsync::cancel_query(bool reconnect)
 {
-  // TODO use PQcancel();
   assert(state == PqState::QUERY);
 
-  pg->cancel = PQgetCancel(pg->conn);
-  if (pg->cancel == NULL) {
-    if (reconnect) {
-      disconnect();
-      start_connect();
-    }
-  } else {
-    if (PQcancel(pg->cancel, NULL, 0) == 0) {
-      PQfreeCancel(pg->cancel);
-      if (reconnect) {
-        disconnect();
-        start_connect();
-      }
-    } else {
-      state = PqState::CANCEL;
-    }
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  // cancel request is sent by wait_result without blocking
+  pg->cancel_conn = PQcancelCreate(pg->conn);
+  if (pg->cancel_conn != nullptr && PQcancelStart(pg->cancel_conn) != 0) {
+    state = PqState::CANCEL;
+    return;
+  }
+#endif//LIBPQ_HAS_ASYNC_CANCEL
+
+  // query can't be canceled (PQcancel of libpq < 17 blocks until server 
+  // answers), connection is dropped, server stops the query when it notices
+  // the closed socket (not canceled again)
+  state = PqState::CANCEL;
+  disconnect();
+  if (reconnect) {
+    start_connect();
   }
 }
 
@@ -151,6 +392,8 @@ bool PqAsync::poll()
     case PqState::CANCEL :
       wait_result();
       return true;
+    case PqState::COPY :
+      return false;
     default:
       throw std::runtime_error("wrong state in poll");
   }
@@ -221,7 +464,38 @@ bool PqAsync::send_query()
   clear_result();
 
   if (check_connected()) {
-    if (PQsendQuery(pg->conn, query_) == 0) {
+    int sent;
+    if (reset_pending_ && (copy_ || (nparams_ == 0 && !prepared_ && !preamble_))) {
+      // simple query can't be pipelined, reset is sent on its own, query is
+      // sent when it is done
+      reset_pending_ = false;
+      pending_.push_back(PqPending::RESET);
+      sent = PQsendQuery(pg->conn, k_reset_query);
+    } else if (copy_) {
+      sent = send_copy();
+    } else if (reset_pending_ || preamble_ || batch_count_) {
+      sent = send_pipeline();
+    } else if (prepared_) {
+      auto it = statements_.find(query_);
+      if (it != statements_.end()) {
+        sent = PQsendQueryPrepared(pg->conn, it->second.c_str(), nparams_, 
+                                   param_values_, param_lengths_, 
+                                   param_formats_, 0);
+      } else {
+        // statement is prepared first, query is sent when it is ready
+        preparing_ = "c2h5oh_" + std::to_string(++statement_id_);
+        sent = PQsendPrepare(pg->conn, preparing_.c_str(), query_, nparams_,
+                             nullptr);
+      }
+    } else {
+      sent = nparams_ == 0 ? PQsendQuery(pg->conn, query_) : 
+        PQsendQueryParams(pg->conn, query_, nparams_, nullptr, param_values_,
+                          param_lengths_, param_formats_, 0);
+    }
+    if (sent == 0) {
+      // query is not sent, libpq error is the result
+      result_          = PQerrorMessage(pg->conn);
+      result_is_error_ = true;
       state = PqState::CONNECTED;
       return true;
     } else {
@@ -231,11 +505,262 @@ bool PqAsync::send_query()
   return false;
 }
 
+//-----------------------------------------------------------------------------
+int PqAsync::send_copy()
+{
+  // $n is replaced with quoted literal, escaping depends on connection; 
+  // literals, quoted identifiers and comments are left as is
+  std::string query;
+  for(const char * s = query_; *s; s++) {
+    const char * e = sql_skip(query_, s);
+    if (e != s) {
+      query.append(s, e);
+      s = e - 1;
+      continue;
+    }
+    int n = 0;
+    e = s + 1;
+    if (*s == '$' && (s == query_ || !is_ident_char(s[-1]))) {
+      for(; isdigit((unsigned char)*e); e++) {
+        n = n * 10 + *e - '0';
+      }
+    }
+    if (n < 1 || n > nparams_) {
+      query += *s;
+      continue;
+    }
+    const char * v = param_values_[n - 1];
+    size_t len = param_formats_ && param_formats_[n - 1] ? 
+      param_lengths_[n - 1] : strlen(v);
+    char * literal = PQescapeLiteral(pg->conn, v, len);
+    if (literal == nullptr) {
+      return 0;
+    }
+    query += literal;
+    PQfreemem(literal);
+    s = e - 1;
+  }
+  return PQsendQuery(pg->conn, query.c_str());
+}
+
+//-----------------------------------------------------------------------------
+int PqAsync::send_pipeline()
+{
+  // session reset, preamble and query are sent in one round trip, reset is
+  // synced apart from query, so query error doesn't roll it back, preamble
+  // and query are executed in one transaction, each batch query in own one
+  if (PQenterPipelineMode(pg->conn) == 0) {
+    return 0;
+  }
+  batch_.clear();
+  if (reset_pending_) {
+    reset_pending_ = false;
+    for(auto statement : k_reset_statements) {
+      if (PQsendQueryParams(pg->conn, statement, 0, nullptr, nullptr, nullptr,
+                            nullptr, 0) == 0) 
+      {
+        return 0;
+      }
+      pending_.push_back(PqPending::RESET);
+    }
+    if (PQpipelineSync(pg->conn) == 0) {
+      return 0;
+    }
+    syncs_++;
+  }
+  const char * name = nullptr;
+  if (prepared_) {
+    auto it = statements_.find(query_);
+    if (it != statements_.end()) {
+      name = it->second.c_str();
+    } else {
+      // statement is prepared and executed in the same pipeline
+      preparing_ = "c2h5oh_" + std::to_string(++statement_id_);
+      if (PQsendPrepare(pg->conn, preparing_.c_str(), query_, nparams_, 
+                        nullptr) == 0) 
+      {
+        return 0;
+      }
+      pending_.push_back(PqPending::PREPARE);
+      name = preparing_.c_str();
+    }
+  }
+  int count = batch_count_ ? batch_count_ : 1;
+  for(int i = 0; i < count; i++) {
+    if (preamble_) {
+      if (PQsendQueryParams(pg->conn, preamble_, preamble_nparams_, nullptr, 
+                            preamble_values_, preamble_lengths_, nullptr, 0) 
+          == 0) 
+      {
+        return 0;
+      }
+      pending_.push_back(PqPending::PREAMBLE);
+    }
+    auto values  = param_values_ + i * nparams_;
+    auto lengths = param_lengths_ ? param_lengths_ + i * nparams_ : nullptr;
+    auto formats = param_formats_ ? param_formats_ + i * nparams_ : nullptr;
+    int sent = name ? 
+      PQsendQueryPrepared(pg->conn, name, nparams_, values, lengths, formats, 
+                          0) :
+      PQsendQueryParams(pg->conn, query_, nparams_, nullptr, values, lengths,
+                        formats, 0);
+    if (sent == 0) {
+      return 0;
+    }
+    if (batch_count_) {
+      pending_.push_back(PqPending::ITEM);
+    }
+    if (PQpipelineSync(pg->conn) == 0) {
+      return 0;
+    }
+    syncs_++;
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+// appends json string to dst
+static void append_json_string(std::string & dst, std::string_view s)
+{
+  static const char hex[] = "0123456789abcdef";
+  dst += '"';
+  for(unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      dst += '\\';
+      dst += c;
+    } else if (c < 0x20) {
+      dst += "\\u00";
+      dst += hex[c >> 4];
+      dst += hex[c & 0xf];
+    } else {
+      dst += c;
+    }
+  }
+  dst += '"';
+}
+
+//-----------------------------------------------------------------------------
+// builtin types oids, pg_type.h is server side header
+enum : Oid {
+  k_bool_oid = 16, k_int8_oid = 20, k_int2_oid = 21, k_int4_oid = 23, 
+  k_oid_oid = 26, k_json_oid = 114, k_float4_oid = 700, k_float8_oid = 701, 
+  k_numeric_oid = 1700, k_jsonb_oid = 3802
+};
+
+//-----------------------------------------------------------------------------
+// appends result rows as json array of objects, numbers, booleans and json
+// are not quoted, NaN and Infinity are strings
+static void append_json_rows(std::string & dst, const PGresult * result)
+{
+  int rows   = PQntuples(result);
+  int fields = PQnfields(result);
+  std::vector<std::string> names(fields);
+  size_t size = 2;
+  for(int j = 0; j < fields; j++) {
+    append_json_string(names[j], PQfname(result, j));
+    names[j] += ':';
+    size += names[j].size() * rows;
+  }
+  for(int i = 0; i < rows; i++) {
+    for(int j = 0; j < fields; j++) {
+      size += PQgetlength(result, i, j) + 4;
+    }
+  }
+  dst.reserve(dst.size() + size + rows * 3);
+
+  dst += '[';
+  for(int i = 0; i < rows; i++) {
+    dst += i ? ",{" : "{";
+    for(int j = 0; j < fields; j++) {
+      if (j) {
+        dst += ',';
+      }
+      dst += names[j];
+      if (PQgetisnull(result, i, j)) {
+        dst += "null";
+        continue;
+      }
+      const char * v = PQgetvalue(result, i, j);
+      switch(PQftype(result, j)) {
+        case k_bool_oid :
+          dst += *v == 't' ? "true" : "false";
+          break;
+        case k_int2_oid : case k_int4_oid : case k_int8_oid : case k_oid_oid :
+        case k_json_oid : case k_jsonb_oid :
+          dst.append(v, PQgetlength(result, i, j));
+          break;
+        case k_float4_oid : case k_float8_oid : case k_numeric_oid :
+          if (isdigit((unsigned char)v[0]) || 
+              (v[0] == '-' && isdigit((unsigned char)v[1]))) 
+          {
+            dst.append(v, PQgetlength(result, i, j));
+          } else {
+            append_json_string(dst, v);
+          }
+          break;
+        default :
+          append_json_string(dst, std::string_view(v, PQgetlength(result, i, j)));
+      }
+    }
+    dst += '}';
+  }
+  dst += ']';
+}
+
+//-----------------------------------------------------------------------------
+void PqAsync::pop_pending()
+{
+  switch(pending_.front()) {
+    case PqPending::RESET :
+      clear_result();
+      break;
+    case PqPending::PREPARE :
+      // prepare error is returned as query error
+      if (!result_is_error_) {
+        statements_.emplace(query_, std::move(preparing_));
+        clear_result();
+      }
+      preparing_.clear();
+      break;
+    case PqPending::PREAMBLE :
+      // preamble error is returned as query error
+      if (!result_is_error_) {
+        clear_result();
+      }
+      break;
+    case PqPending::ITEM :
+      if (!batch_.empty()) {
+        batch_ += ',';
+      }
+      if (result_is_error_) {
+        batch_ += "{\"status\":500,\"error\":";
+        append_json_string(batch_, result_);
+        batch_ += '}';
+      } else if (has_result_ && !result_is_null_) {
+        batch_ += result_;
+      } else {
+        batch_ += "null";
+      }
+      clear_result();
+      break;
+  }
+  pending_.pop_front();
+}
+
 //-----------------------------------------------------------------------------
 bool PqAsync::wait_result()
 {
   assert(state == PqState::QUERY || state == PqState::CANCEL);
 
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  if (pg->cancel_conn != nullptr) {
+    auto s = PQcancelPoll(pg->cancel_conn);
+    if (s == PGRES_POLLING_OK || s == PGRES_POLLING_FAILED) {
+      pg->free_cancel();
+    }
+  }
+#endif//LIBPQ_HAS_ASYNC_CANCEL
+
   if (check_connected()) {
     if (PQisBusy(pg->conn) == 1) {
       if (PQconsumeInput(pg->conn) == 0) {
@@ -246,18 +771,70 @@ bool PqAsync::wait_result()
     }
     while (PQisBusy(pg->conn) == 0) {
       auto result = PQgetResult(pg->conn);
+      if (result != nullptr && PQresultStatus(result) == PGRES_PIPELINE_SYNC) {
+        // pipeline is done after last sync
+        PQclear(result);
+        if (--syncs_ > 0) {
+          continue;
+        }
+        PQexitPipelineMode(pg->conn);
+        if (batch_count_) {
+          result_          = "[" + batch_ + "]";
+          has_result_      = true;
+          result_is_error_ = false;
+        }
+        result = nullptr;
+      } else if (nullptr == result && (!pending_.empty() || syncs_ > 0)) {
+        // pipelined query waits for sync
+        if (!pending_.empty()) {
+          pop_pending();
+        }
+        if (syncs_ > 0) {
+          continue;
+        }
+        if (state == PqState::QUERY) {
+          state = PqState::CONNECTED;
+          send_query();
+          return false;
+        }
+      }
       if (nullptr == result) {
         if (state == PqState::CANCEL) {
-          PQfreeCancel(pg->cancel);
-          pg->cancel = NULL;
+          pg->free_cancel();
+          preparing_.clear();
           state = PqState::CONNECTED;
           return false;
+        } else if (!preparing_.empty()) {
+          // statement is prepared, send query or return prepare error
+          if (result_is_error_) {
+            preparing_.clear();
+            state = PqState::RESULT;
+            return true;
+          }
+          statements_.emplace(query_, std::move(preparing_));
+          preparing_.clear();
+          state = PqState::CONNECTED;
+          send_query();
+          return false;
         } else {
           state = PqState::RESULT;
           return true;
         }
       } else {
-        if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+        if (PQresultStatus(result) == PGRES_COPY_OUT || 
+            PQresultStatus(result) == PGRES_COPY_IN) 
+        {
+          // copy data is transferred by caller, canceled copy is dropped
+          PQclear(result);
+          if (state == PqState::CANCEL) {
+            disconnect();
+            return false;
+          }
+          state = PqState::COPY;
+          return true;
+        } else if (PQresultStatus(result) == PGRES_PIPELINE_ABORTED) {
+          // skipped after preamble or prepare error, the error is returned
+        } else if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
           has_result_ = true;
           result_is_error_ = true;
           const char * err =  PQresultErrorField(result, PG_DIAG_SQLSTATE);
@@ -269,6 +846,11 @@ bool PqAsync::wait_result()
           } else {
             result_.clear();
           }
+        } else if (rows_ && PQresultStatus(result) == PGRES_TUPLES_OK) {
+          result_.clear();
+          append_json_rows(result_, result);
+          has_result_     = true;
+          result_is_null_ = false;
         } else if (PQntuples(result) > 0 && PQnfields(result) > 0) {
           result_ = PQgetvalue(result, 0, 0);
           has_result_   = true;
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <deque>
 #include <string>
 #include <memory>
+#include <unordered_map>
 
 namespace Pq {
   
 //-----------------------------------------------------------------------------
 struct Pg; // UGLY an ugly way to hide libpq dependencies from header file
-enum class PqState { START, CONNECTING, CONNECTED, QUERY, RESULT, CANCEL };
+enum class PqState { START, CONNECTING, CONNECTED, QUERY, RESULT, CANCEL, COPY };
+/** Pipelined statement which result is not returned as query result */
+enum class PqPending { RESET, PREPARE, PREAMBLE, ITEM };
 
 //-----------------------------------------------------------------------------
 /** Postgresql interface */
@@ -26,10 +30,62 @@ public:
   bool connect(const char * conn_string, bool non_blocking = false);
   /** Disconnect from database */
   void disconnect();
+  /** Check for connection is established or in progress */
+  bool is_connected() const { return state != PqState::START; }
+  /** Check for query or its cancel is in progress */
+  bool is_busy() const { 
+    return state == PqState::QUERY || state == PqState::CANCEL; 
+  }
   /** Perform query */
   bool do_query(const char * query);
-  /** Abort current query */
+  /** Perform query with parameters, parameters are not copied and have to 
+   * be valid while query is in progress, see PQsendQueryParams. Prepared 
+   * query is prepared once per connection and executed by statement name */
+  bool do_query(const char * query, int nparams, const char * const * values,
+                const int * lengths, const int * formats, 
+                bool prepared = false);
+  /** Perform query for each of count parameters sets in one round trip, 
+   * values contain count * nparams parameters, each query is executed in 
+   * own transaction. Result is json array of query results, query error is
+   * {"status":500,"error":"..."} item */
+  bool do_batch(const char * query, int count, int nparams, 
+                const char * const * values, const int * lengths, 
+                const int * formats, bool prepared = false);
+  /** Perform COPY query, $1..$nparams in query text are replaced with 
+   * quoted literals of parameters (COPY has no bind parameters), binary 
+   * parameters are passed as text of given length. Poll completes when 
+   * copy is started (is_copy) or with an error, preamble is not used */
+  bool do_copy(const char * query, int nparams, const char * const * values,
+               const int * lengths, const int * formats);
+  /** Check for COPY is in progress, see get_copy_data */
+  bool is_copy() const { return state == PqState::COPY; }
+  /** Read COPY TO STDOUT data without blocking, returns data length, data 
+   * is valid until next call, 0 - no data yet, -1 - copy is done, poll 
+   * completes with COPY command result */
+  int get_copy_data(const char ** data);
+  /** Send COPY FROM STDIN data without blocking, returns 1 - data is 
+   * queued, 0 - previous data is not sent yet, retry later, -1 - copy is 
+   * failed, poll completes with the error */
+  int put_copy_data(const char * data, int len);
+  /** Finish COPY FROM STDIN, returns 1 - poll completes with COPY command 
+   * result, 0 - retry later, -1 - poll completes with the error */
+  int put_copy_end();
+  /** Set statement executed before next queries in the same transaction and
+   * round trip, parameters are text, not copied and have to be valid while
+   * query is in progress. Preamble error is returned as query error, 
+   * preamble is cleared by abort */
+  void set_preamble(const char * query, int nparams, 
+                    const char * const * values, const int * lengths);
+  /** Return rows of next queries as json array of objects, column values
+   * are encoded by type, see wait_result. Cleared by abort */
+  void set_rows(bool rows) { rows_ = rows; }
+  /** Abort current query, query is canceled and connection is busy until
+   * cancel is done, see poll. Without non-blocking cancel (libpq < 17) 
+   * connection is dropped */
   void abort();
+  /** Reset session state before next query, reset statements are pipelined 
+   * with query parameters, query without parameters waits for reset */
+  void reset_session() { reset_pending_ = state != PqState::START; }
   /** Poll query, returns true if query completed */
   bool poll();
   /** Check for result is ready */
@@ -48,6 +104,26 @@ private:
   std::unique_ptr<Pg> pg;       // libpq structures
   const char * conn_string_;    // connection string
   const char * query_;          // current query
+  int                  nparams_;        // current query parameters count
+  const char * const * param_values_;   // parameters values
+  const int *          param_lengths_;  // parameters lengths
+  const int *          param_formats_;  // parameters formats
+  bool                 prepared_;       // query is executed as prepared
+  std::string          preparing_;      // statement name being prepared
+  unsigned             statement_id_;   // last prepared statement id
+  std::unordered_map<std::string, std::string> statements_; // query -> name
+  bool                 reset_pending_;  // session reset is sent before query
+  std::deque<PqPending> pending_;       // pipelined results to skip
+  int                  syncs_;          // pipeline syncs pending
+  int                  batch_count_;    // batch queries count, 0 - no batch
+  std::string          batch_;          // batch results
+  const char *         preamble_;          // statement executed before query
+  int                  preamble_nparams_;  // preamble parameters count
+  const char * const * preamble_values_;   // preamble parameters values
+  const int *          preamble_lengths_;  // preamble parameters lengths
+  bool                 rows_;           // result is json array of rows
+  bool                 copy_;           // query is COPY
+  char *               copy_buf_;       // last COPY data row
   PqState state;                // sate
   std::string last_error;       // last error message
   std::string result_;          // last result
@@ -61,6 +137,10 @@ private:
   void start_connect();   // initiate connection process
   void wait_connected();  // wait while connection to pg established
   bool send_query();      // send query
+  int  send_pipeline();   // send reset, preamble and query in pipeline
+  int  send_copy();       // send COPY query with literal parameters
+  void free_copy_buf();   // free last COPY data row
+  void pop_pending();     // skip pipelined statement result
   bool wait_result();     // wait query result
   void cancel_query(bool reconnect = true); // cancel current query
 };
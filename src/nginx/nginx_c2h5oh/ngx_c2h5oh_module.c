@@ -10,20 +10,66 @@
 #define NGX_C2H5OH_DEFAULT_TIMEOUT 1000   // ms
 #define NGX_C2H5OH_JSMN_TOKENS     128
 
-const u_char k_ngx_c2h5oh_select[]        = "select web.";
+// methods allowed by default and methods with request body
+#define NGX_C2H5OH_METHODS      (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST)
+#define NGX_C2H5OH_BODY_METHODS (NGX_HTTP_POST|NGX_HTTP_PUT|NGX_HTTP_PATCH)
+
+#define NGX_C2H5OH_JSON_KEY_IS(json, t, key) \
+  ((t)->end - (t)->start == sizeof(key) - 1 && \
+   ngx_strncmp((json) + (t)->start, key, sizeof(key) - 1) == 0)
+#define NGX_C2H5OH_CONTENT_TYPE_IS(r, type) \
+  ngx_c2h5oh_content_type_is(r, (u_char *)type, sizeof(type) - 1)
+
+const u_char k_ngx_c2h5oh_select[]        = "select ";
+const u_char k_ngx_c2h5oh_from[]          = "* from ";
+const u_char k_ngx_c2h5oh_copy[]          = "copy (";
+const u_char k_ngx_c2h5oh_copy_csv[]      = ") to stdout (format csv, header)";
+const u_char k_ngx_c2h5oh_copy_text[]     = ") to stdout";
+const u_char k_ngx_c2h5oh_statement_timeout[] = 
+  "set_config('statement_timeout',$1::text,true)";
+const u_char k_ngx_c2h5oh_schema[]        = "web.";
+const u_char k_ngx_c2h5oh_params_max[]    = 
+  "($1::varchar,$2::jsonb,$3::jsonb,b=>$4::json::jsonb,m=>$5::varchar);";
+static ngx_str_t k_ngx_c2h5oh_get          = ngx_string("GET");
 const u_char ngx_c2h5oh_content_type[]    = "application/json; charset=utf-8";
+static ngx_str_t k_ngx_c2h5oh_csv_type     = 
+  ngx_string("text/csv; charset=utf-8");
+static ngx_str_t k_ngx_c2h5oh_text_type    = 
+  ngx_string("text/tab-separated-values; charset=utf-8");
 
 static jsmntok_t  *ngx_c2h5oh_js_tokens = NULL;
 static int         ngx_c2h5oh_js_tokens_count = 0;
 static jsmn_parser ngx_c2h5oh_jsmn_parser = {0, 0, 0};
 
+static ngx_msec_t  ngx_c2h5oh_maintain_interval = 0; // 0 - no idle reaping
+static ngx_event_t ngx_c2h5oh_maintain_timer;
+static ngx_event_t ngx_c2h5oh_drain_timer;  // polls canceled queries
+
+static ngx_conf_bitmask_t ngx_c2h5oh_methods_mask[] = {
+  { ngx_string("GET"),     NGX_HTTP_GET     },
+  { ngx_string("HEAD"),    NGX_HTTP_HEAD    },
+  { ngx_string("POST"),    NGX_HTTP_POST    },
+  { ngx_string("PUT"),     NGX_HTTP_PUT     },
+  { ngx_string("PATCH"),   NGX_HTTP_PATCH   },
+  { ngx_string("DELETE"),  NGX_HTTP_DELETE  },
+  { ngx_string("OPTIONS"), NGX_HTTP_OPTIONS },
+  { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t ngx_c2h5oh_copy_formats[] = {
+  { ngx_string("off"),  0                    },
+  { ngx_string("csv"),  NGX_C2H5OH_COPY_CSV  },
+  { ngx_string("text"), NGX_C2H5OH_COPY_TEXT },
+  { ngx_null_string, 0 }
+};
+
 //-----------------------------------------------------------------------------
 static ngx_http_module_t  ngx_c2h5oh_module_ctx = {
   NULL,                            /* preconfiguration */
   NULL,                            /* postconfiguration */
 
-  NULL,                            /* create main configuration */
-  NULL,                            /* init main configuration */
+  ngx_c2h5oh_create_main_conf,     /* create main configuration */
+  ngx_c2h5oh_init_main_conf,       /* init main configuration */
 
   NULL,                            /* create server configuration */
   NULL,                            /* merge server configuration */
@@ -40,12 +86,24 @@ static ngx_command_t  ngx_c2h5oh_commands[] = {
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
     NULL },
+  { ngx_string("c2h5oh_pool"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_c2h5oh_pool,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
   { ngx_string("c2h5oh_timeout"),
     NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     ngx_conf_set_msec_slot,
     NGX_HTTP_LOC_CONF_OFFSET,
     offsetof(ngx_c2h5oh_loc_conf_t, timeout),
     NULL },
+  { ngx_string("c2h5oh_statement_timeout"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, statement_timeout),
+    NULL },
   { ngx_string("c2h5oh_root"),
     NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     ngx_conf_set_str_slot,
@@ -58,15 +116,161 @@ static ngx_command_t  ngx_c2h5oh_commands[] = {
     NGX_HTTP_LOC_CONF_OFFSET,
     offsetof(ngx_c2h5oh_loc_conf_t, route),
     NULL },
+  { ngx_string("c2h5oh_methods"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    ngx_conf_set_bitmask_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, methods),
+    &ngx_c2h5oh_methods_mask },
+  { ngx_string("c2h5oh_cache_size"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_main_conf_t, cache_size),
+    NULL },
+  { ngx_string("c2h5oh_cache_gzip_level"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_main_conf_t, cache_gzip_level),
+    NULL },
+  { ngx_string("c2h5oh_connections_max"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_main_conf_t, connections_max),
+    NULL },
+  { ngx_string("c2h5oh_auth_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_main_conf_t, auth_zone_size),
+    NULL },
+  { ngx_string("c2h5oh_file_root"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, file_root),
+    NULL },
+  { ngx_string("c2h5oh_auth_cache"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_set_complex_value_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, auth_key),
+    NULL },
+  { ngx_string("c2h5oh_map"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    ngx_c2h5oh_map,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+  { ngx_string("c2h5oh_json_body"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, json_body),
+    NULL },
+  { ngx_string("c2h5oh_batch"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, batch),
+    NULL },
+  { ngx_string("c2h5oh_priority"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, priority),
+    NULL },
+  { ngx_string("c2h5oh_priority_class"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_c2h5oh_priority_class,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  { ngx_string("c2h5oh_hedge"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE23,
+    ngx_c2h5oh_hedge,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+  { ngx_string("c2h5oh_rows"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, rows),
+    NULL },
+  { ngx_string("c2h5oh_copy_out"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_enum_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, copy_out),
+    &ngx_c2h5oh_copy_formats },
+  { ngx_string("c2h5oh_copy_in"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, copy_in),
+    NULL },
+  { ngx_string("c2h5oh_upload"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_c2h5oh_loc_conf_t, upload),
+    NULL },
+  { ngx_string("c2h5oh_set"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    ngx_c2h5oh_set,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
   ngx_null_command
 };
 
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_maintain_handler(ngx_event_t * ev)
+{
+  c2h5oh_maintain(ngx_time());
+  ngx_add_timer(ev, ngx_c2h5oh_maintain_interval);
+}
+
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_drain_handler(ngx_event_t * ev)
+{
+  if (c2h5oh_drain(ngx_time()) > 0) {
+    ngx_add_timer(ev, (ngx_msec_t)1);
+  }
+}
+
 //-----------------------------------------------------------------------------
 ngx_int_t ngx_c2h5oh_init_process(ngx_cycle_t * c) 
 {
+  ngx_c2h5oh_main_conf_t * mcf;
+
   ngx_c2h5oh_js_tokens_count = NGX_C2H5OH_JSMN_TOKENS;
   ngx_c2h5oh_js_tokens = malloc(sizeof(jsmntok_t) * ngx_c2h5oh_js_tokens_count);
 
+  if (ngx_c2h5oh_maintain_interval) {
+    ngx_c2h5oh_maintain_timer.handler    = ngx_c2h5oh_maintain_handler;
+    ngx_c2h5oh_maintain_timer.log        = c->log;
+    ngx_c2h5oh_maintain_timer.cancelable = 1;
+    ngx_add_timer(&ngx_c2h5oh_maintain_timer, ngx_c2h5oh_maintain_interval);
+  }
+  ngx_c2h5oh_drain_timer.handler    = ngx_c2h5oh_drain_handler;
+  ngx_c2h5oh_drain_timer.log        = c->log;
+  ngx_c2h5oh_drain_timer.cancelable = 1;
+
+  mcf = ngx_http_cycle_get_module_main_conf(c, ngx_c2h5oh_module);
+  if (mcf != NULL) {
+    c2h5oh_cache_init(mcf->cache_size, mcf->cache_gzip_level);
+    // respawned worker takes the slot of died one and returns its budget
+    if (mcf->budget_zone != NULL && ngx_process_slot < C2H5OH_BUDGET_SLOTS) {
+      c2h5oh_module_set_budget(mcf->budget_zone->data, ngx_process_slot);
+    }
+  }
+
   return NGX_OK;
 }
 
@@ -94,6 +298,161 @@ ngx_module_t  ngx_c2h5oh_module = {
   NGX_MODULE_V1_PADDING
 };
 
+//-----------------------------------------------------------------------------
+static void * ngx_c2h5oh_create_main_conf(ngx_conf_t *cf)
+{
+  ngx_c2h5oh_main_conf_t  *conf;
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_c2h5oh_main_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+  conf->cache_size       = NGX_CONF_UNSET_SIZE;
+  conf->cache_gzip_level = NGX_CONF_UNSET;
+  conf->connections_max  = NGX_CONF_UNSET;
+  conf->auth_zone_size   = NGX_CONF_UNSET_SIZE;
+  conf->pool_policy      = NGX_CONF_UNSET;
+  conf->max_idle_time    = NGX_CONF_UNSET;
+  conf->min_size         = NGX_CONF_UNSET;
+  conf->target_wait      = NGX_CONF_UNSET;
+  conf->reset            = NGX_CONF_UNSET;
+  conf->shed             = NGX_CONF_UNSET;
+  conf->shed_interval    = NGX_CONF_UNSET;
+  return conf;
+}
+
+//-----------------------------------------------------------------------------
+// connections budget is kept across reloads, exiting workers return theirs,
+// budget of killed ones is returned by next process of their slot
+static ngx_int_t
+ngx_c2h5oh_init_budget_zone(ngx_shm_zone_t * zone, void * data)
+{
+  ngx_c2h5oh_main_conf_t * mcf = zone->data;
+  ngx_slab_pool_t        * shpool;
+  c2h5oh_budget_t        * budget = data;
+
+  if (budget == NULL) {
+    shpool = (ngx_slab_pool_t *)zone->shm.addr;
+    budget = ngx_slab_alloc(shpool, sizeof(c2h5oh_budget_t));
+    if (budget == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_memzero(budget, sizeof(c2h5oh_budget_t));
+  }
+  budget->max = mcf->connections_max;
+  zone->data  = budget;
+
+  return NGX_OK;
+}
+
+//-----------------------------------------------------------------------------
+// auth decisions are kept across reloads
+static ngx_int_t
+ngx_c2h5oh_init_auth_zone(ngx_shm_zone_t * zone, void * data)
+{
+  ngx_c2h5oh_auth_cache_t * ocache = data;
+  ngx_c2h5oh_auth_cache_t * cache  = zone->data;
+
+  if (ocache != NULL) {
+    *cache = *ocache;
+    return NGX_OK;
+  }
+  cache->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+  if (zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
+  cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_c2h5oh_auth_sh_t));
+  if (cache->sh == NULL) {
+    return NGX_ERROR;
+  }
+  cache->shpool->data = cache->sh;
+  ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, 
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->sh->queue);
+  cache->sh->generation = 0;
+  // full cache evicts least recently used decisions, it is not an error
+  cache->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+//-----------------------------------------------------------------------------
+static char * ngx_c2h5oh_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+  ngx_c2h5oh_main_conf_t *mcf = conf;
+  ngx_conf_init_size_value(mcf->cache_size, 0);
+  ngx_conf_init_value(mcf->cache_gzip_level, 6);
+  if (mcf->cache_gzip_level < 1 || mcf->cache_gzip_level > 9) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_cache_gzip_level must be 1..9");
+    return NGX_CONF_ERROR;
+  }
+  if (mcf->connections_max != NGX_CONF_UNSET) {
+    if (mcf->connections_max <= 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_connections_max is invalid");
+      return NGX_CONF_ERROR;
+    }
+    ngx_str_t name = ngx_string("c2h5oh_budget");
+    mcf->budget_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, 
+                                             &ngx_c2h5oh_module);
+    if (mcf->budget_zone == NULL) {
+      return NGX_CONF_ERROR;
+    }
+    mcf->budget_zone->init = ngx_c2h5oh_init_budget_zone;
+    mcf->budget_zone->data = mcf;
+  }
+  ngx_conf_init_size_value(mcf->auth_zone_size, 0);
+  if (mcf->auth_zone_size) {
+    if (mcf->auth_zone_size < 8 * ngx_pagesize) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_auth_zone is too small");
+      return NGX_CONF_ERROR;
+    }
+    ngx_str_t name = ngx_string("c2h5oh_auth");
+    mcf->auth_zone = ngx_shared_memory_add(cf, &name, mcf->auth_zone_size, 
+                                           &ngx_c2h5oh_module);
+    if (mcf->auth_zone == NULL) {
+      return NGX_CONF_ERROR;
+    }
+    mcf->auth_zone->init = ngx_c2h5oh_init_auth_zone;
+    mcf->auth_zone->data = ngx_pcalloc(cf->pool, sizeof(ngx_c2h5oh_auth_cache_t));
+    if (mcf->auth_zone->data == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  // pool is process wide, it is set up once when all locations are read
+  ngx_conf_init_value(mcf->pool_policy, C2H5OH_POOL_LIFO);
+  ngx_conf_init_value(mcf->max_idle_time, 0);
+  ngx_conf_init_value(mcf->min_size, 0);
+  ngx_conf_init_value(mcf->target_wait, 10);
+  ngx_conf_init_value(mcf->reset, 0);
+  ngx_conf_init_value(mcf->shed, 0);
+  ngx_conf_init_value(mcf->shed_interval, 100);
+  // idle connections are checked twice per max_idle_time, adaptive pool
+  // shrinks by 60 seconds idle connections if max_idle_time is not set
+  ngx_c2h5oh_maintain_interval = 
+    (mcf->max_idle_time ? mcf->max_idle_time : mcf->min_size ? 60 : 0) * 500;
+  if (mcf->pool_size == 0) {
+    return NGX_CONF_OK;
+  }
+  if ((size_t)mcf->min_size > mcf->pool_size) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                       "c2h5oh_pool min is greater than c2h5oh_pass pool size");
+    return NGX_CONF_ERROR;
+  }
+  c2h5oh_module_set_pool(mcf->pool_policy, mcf->max_idle_time);
+  c2h5oh_module_set_pool_size(mcf->min_size, mcf->target_wait);
+  c2h5oh_module_set_reset(mcf->reset);
+  c2h5oh_module_set_shed(mcf->shed, mcf->shed_interval);
+
+  if (c2h5oh_module_init((const char *)mcf->db_path.data, 
+                         mcf->db_path.len, mcf->pool_size) != 0) 
+  {
+    ngx_log_error(NGX_LOG_ERR, cf->log, 0, "[c2h5oh] error init c2h5oh");
+    return NGX_CONF_ERROR;
+  }
+  return NGX_CONF_OK;
+}
+
 //-----------------------------------------------------------------------------
 static void * ngx_c2h5oh_create_loc_conf(ngx_conf_t *cf)
 {
@@ -105,6 +464,14 @@ static void * ngx_c2h5oh_create_loc_conf(ngx_conf_t *cf)
   conf->enabled = 0;
   conf->pool_size = NGX_CONF_UNSET_SIZE;
   conf->timeout   = NGX_CONF_UNSET_MSEC;
+  conf->batch     = NGX_CONF_UNSET;
+  conf->json_body = NGX_CONF_UNSET;
+  conf->statement_timeout = NGX_CONF_UNSET;
+  conf->priority  = NGX_CONF_UNSET;
+  conf->hedge     = NGX_CONF_UNSET;
+  conf->rows      = NGX_CONF_UNSET;
+  conf->copy_out  = NGX_CONF_UNSET_UINT;
+  conf->upload    = NGX_CONF_UNSET;
   conf->db_path.len  = NGX_CONF_UNSET_UINT;
   conf->db_path.data = NGX_CONF_UNSET_PTR;
   return conf;
@@ -116,10 +483,61 @@ ngx_c2h5oh_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
   ngx_c2h5oh_loc_conf_t *prev = parent;
   ngx_c2h5oh_loc_conf_t *conf = child;
+  ngx_c2h5oh_main_conf_t *mcf = 
+    ngx_http_conf_get_module_main_conf(cf, ngx_c2h5oh_module);
   ngx_conf_merge_msec_value(conf->timeout, prev->timeout, NGX_C2H5OH_DEFAULT_TIMEOUT);
   ngx_conf_merge_str_value(conf->db_path, prev->db_path, "");
   ngx_conf_merge_str_value(conf->root, prev->root, "");
   ngx_conf_merge_size_value(conf->pool_size, prev->pool_size, NGX_CONF_UNSET_SIZE);
+  ngx_conf_merge_bitmask_value(conf->methods, prev->methods, NGX_C2H5OH_METHODS);
+  ngx_conf_merge_value(conf->batch, prev->batch, 0);
+  ngx_conf_merge_value(conf->json_body, prev->json_body, 0);
+  ngx_conf_merge_value(conf->statement_timeout, prev->statement_timeout, 0);
+  ngx_conf_merge_value(conf->priority, prev->priority, 0);
+  ngx_conf_merge_value(conf->hedge, prev->hedge, 0);
+  if (conf->latency == NULL) {
+    conf->latency = prev->latency;
+  }
+  ngx_conf_merge_value(conf->rows, prev->rows, 0);
+  ngx_conf_merge_uint_value(conf->copy_out, prev->copy_out, 0);
+  ngx_conf_merge_str_value(conf->copy_in, prev->copy_in, "");
+  ngx_conf_merge_value(conf->upload, prev->upload, 0);
+  if (conf->auth_key == NULL) {
+    conf->auth_key = prev->auth_key;
+  }
+  ngx_conf_merge_str_value(conf->file_root, prev->file_root, "");
+  if (conf->file_root.len && 
+      ngx_conf_full_name(cf->cycle, &conf->file_root, 0) != NGX_OK) 
+  {
+    return NGX_CONF_ERROR;
+  }
+  if (conf->auth_key != NULL && mcf->auth_zone == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_auth_cache requires c2h5oh_auth_zone");
+    return NGX_CONF_ERROR;
+  }
+  if (conf->priority < 0 || conf->priority >= C2H5OH_MAX_CLASSES) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                       "c2h5oh_priority has to be 0..%d", C2H5OH_MAX_CLASSES - 1);
+    return NGX_CONF_ERROR;
+  }
+  if (conf->settings == NULL) {
+    conf->settings = prev->settings;
+  }
+  if (conf->map_keys == NULL) {
+    conf->map = prev->map;
+  } else {
+    ngx_hash_init_t hash;
+    hash.hash        = &conf->map;
+    hash.key         = ngx_hash_key_lc;
+    hash.max_size    = 1024;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name        = "c2h5oh_map_hash";
+    hash.pool        = cf->pool;
+    hash.temp_pool   = NULL;
+    if (ngx_hash_init(&hash, conf->map_keys->elts, conf->map_keys->nelts) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+  }
   conf->enabled = prev->enabled;
   if (conf->enabled) {
     if (conf->pool_size <= 0) {
@@ -131,18 +549,60 @@ ngx_c2h5oh_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
       ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh db_path is not specified");
       return NGX_CONF_ERROR;
     }
+    if (conf->batch && conf->route.len == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_batch requires c2h5oh_route");
+      return NGX_CONF_ERROR;
+    }
+    if (conf->batch && conf->rows) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_rows can't be used with c2h5oh_batch");
+      return NGX_CONF_ERROR;
+    }
+    if (conf->copy_out && (conf->batch || conf->rows)) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_copy_out can't be used with c2h5oh_batch or c2h5oh_rows");
+      return NGX_CONF_ERROR;
+    }
+    if (conf->copy_in.len && conf->batch) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_copy_in can't be used with c2h5oh_batch");
+      return NGX_CONF_ERROR;
+    }
+    if (conf->upload && (conf->batch || conf->copy_in.len)) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "c2h5oh_upload can't be used with c2h5oh_batch or c2h5oh_copy_in");
+      return NGX_CONF_ERROR;
+    }
   }
   return NGX_CONF_OK;
 }
 
+//-----------------------------------------------------------------------------
+// aborted query is canceled, connection is drained in background
+static void
+ngx_c2h5oh_drain(void)
+{
+  if (!ngx_c2h5oh_drain_timer.timer_set && c2h5oh_drain(ngx_time()) > 0) {
+    ngx_add_timer(&ngx_c2h5oh_drain_timer, (ngx_msec_t)1);
+  }
+}
+
 //-----------------------------------------------------------------------------
 static void
 ngx_c2h5oh_cleanup(void * data) {
   ngx_c2h5oh_ctx_t * ctx = data;
 
+  if (ctx->waiting) {
+    ctx->waiting = 0;
+    c2h5oh_wait_class(ctx->priority, 0);
+  }
+
+  if (ctx->hedge != NULL) {
+    c2h5oh_free(ctx->hedge);
+    ctx->hedge = NULL;
+    ngx_c2h5oh_drain();
+  }
+
   if (ctx->conn != NULL) {
     c2h5oh_free(ctx->conn);
     ctx->conn = NULL;
+    ngx_c2h5oh_drain();
   }
 
   if (ctx->timer.timer_set) {
@@ -155,58 +615,14 @@ static int
 ngx_c2h5oh_parse_args(ngx_http_request_t * r, ngx_str_t * res, u_char * start, 
                       u_char * end, u_char * args_start) 
 {
-  u_char * p = res->data + res->len;
-  u_char c;
-  while(start < end) {
-    if (p != args_start) {
-      *p++ = ',';
-    }
-    *p++ = '"';
-    while((*start == '=' || *start == '&') && start < end) start++;
-    while(*start != '=' && *start != '&' && start < end) {
-      if (*start == '\'') *p++ = '\'';
-      else if (*start == '"') *p++ = '\\';
-      *p++ = *start++;
-    }
-    *p++ = '"'; *p++ = ':'; *p++ = '"';
-    if (*start != '&') {
-      start++;
-      while (*start != '&' && *start != '=' && start < end) {
-        if (*start == '%') {
-          start++;
-          c = *start++;
-          if (c >= 0x30) c -= 0x30;
-          if (c >= 0x10) c -= 0x07;
-          if (c >= 0x10 || start > end) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "[c2h5oh] wrong escape sequence");
-            return -1;
-          }
-          *p = (c << 4);
-          c = *start++;
-          if (c >= 0x30) c -= 0x30;
-          if (c >= 0x10) c -= 0x07;
-          if (c >= 0x10 || start > end) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "[c2h5oh] wrong escape sequence");
-            return -1;
-          }
-          *p += c;
-          c = *p;
-        } else if (*start == '+') {
-          start++;
-          c = ' ';
-        } else {
-          c = *start++;
-        }
-        if (c == '\'') *p++ = '\'';
-        else if (c == '"') *p++ = '\\';
-        *p++ = c;
-      }
-    } else {
-      start++;
-    }
-    *p++ = '"';
+  u_char * p = (u_char *)c2h5oh_args_json((char *)res->data + res->len, 
+                                          (const char *)start, 
+                                          (const char *)end, 
+                                          (const char *)args_start);
+  if (p == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] wrong escape sequence");
+    return -1;
   }
   res->len = p - res->data;
   return 0;
@@ -228,8 +644,7 @@ ngx_c2h5oh_parse_cookies(ngx_str_t * res, ngx_str_t * s, u_char * cookies_start)
     }
     *p++ = '"';
     while(*start != ';' && *start != '=' && start < end) {
-      if (*start == '\'') *p++ = '\'';
-      else if (*start == '"') *p++ = '\\';
+      if (*start == '"' || *start == '\\') *p++ = '\\';
       *p++ = *start++;
     }
     if (*start == ';') {
@@ -242,8 +657,7 @@ ngx_c2h5oh_parse_cookies(ngx_str_t * res, ngx_str_t * s, u_char * cookies_start)
       *p++ = '"'; *p++ = ':'; *p++ = '"';
       while(*start == ' ' && start < end) ++start;
       while(*start != ';' && *start != '=' && start < end) {
-        if (*start == '\'') *p++ = '\'';
-        else if (*start == '"') *p++ = '\\';
+        if (*start == '"' || *start == '\\') *p++ = '\\';
         *p++ = *start++;
       }
       *p++ = '"';
@@ -256,171 +670,648 @@ ngx_c2h5oh_parse_cookies(ngx_str_t * res, ngx_str_t * s, u_char * cookies_start)
   res->len = p - res->data;
 }
 
+//-----------------------------------------------------------------------------
+static ngx_int_t
+ngx_c2h5oh_content_type_is(ngx_http_request_t * r, u_char * type, size_t len)
+{
+  if (r->headers_in.content_type == NULL) {
+    return 0;
+  }
+  ngx_str_t * v = &r->headers_in.content_type->value;
+  if (v->len < len || ngx_strncasecmp(v->data, type, len) != 0) {
+    return 0;
+  }
+  return v->len == len || v->data[len] == ';' || v->data[len] == ' ';
+}
+
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_route_key(ngx_http_request_t * r, ngx_c2h5oh_loc_conf_t * alcf,
+                     ngx_str_t * key)
+{
+  // uri without root and trailing slash, "/" for root itself
+  key->data = r->uri.data + alcf->root.len;
+  key->len  = r->uri.len > alcf->root.len ? r->uri.len - alcf->root.len : 0;
+  if (key->len > 1 && key->data[key->len - 1] == '/') {
+    key->len--;
+  }
+  if (key->len == 0 || (key->len == 1 && key->data[0] == '/')) {
+    ngx_str_set(key, "/");
+  }
+}
+
+//-----------------------------------------------------------------------------
+static ngx_int_t
+ngx_c2h5oh_body_is_form(ngx_http_request_t * r)
+{
+  return ngx_memcmp(r->headers_in.content_type->value.data, 
+                    "application/x-www-form-urlencoded", 
+                    sizeof("application/x-www-form-urlencoded") - 1) == 0;
+}
+
 //-----------------------------------------------------------------------------
 static void
 ngx_c2h5oh_query_data_set_len(ngx_http_request_t *r, ngx_c2h5oh_ctx_t * ctx) 
 {
-  ctx->query.len = sizeof(k_ngx_c2h5oh_select) + sizeof("','{}','{}',null);\0");
   ngx_uint_t i;
   u_char * start; 
   u_char * end;
 
   ngx_c2h5oh_loc_conf_t * alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
-  ctx->query.len += alcf->route.len + sizeof("'',") - 1;
-
-  ctx->query.len += r->uri.len == 1 ? sizeof("index") - 1 : r->uri.len;
-  for(start = end = r->uri.data, end += r->uri.len; start < end; start++) {
-    if (*start == '\'') {
-      ctx->query.len++;
-    }
-  }
 
-  // args
-  if (r->args.len) {
-    ctx->query.len += sizeof("index") - 1;
+  // query text
+  ctx->query.len = sizeof(k_ngx_c2h5oh_select) + sizeof(k_ngx_c2h5oh_from) +
+                   sizeof(k_ngx_c2h5oh_schema) + sizeof(k_ngx_c2h5oh_params_max);
+  if (alcf->copy_out) {
+    ctx->query.len += sizeof(k_ngx_c2h5oh_copy) + sizeof(k_ngx_c2h5oh_copy_csv);
   }
-  for(start = end = r->args.data, end += r->args.len; start < end; start++) {
-    ctx->query.len++;
-    if (*start == '\'' || *start == '"') {
-      ctx->query.len++;
-    } else if (*start == '&') {
-      ctx->query.len += sizeof("\"\":\"\" ") - 1;
-    }
+  if (ctx->upload.len) {
+    ctx->query.len += sizeof(",f=>$5::jsonb");
   }
-
-  if (r->request_body && r->request_body->buf && r->headers_in.content_type 
-      && r->request_body_in_single_buf)
-  {
-    if (ngx_memcmp(r->headers_in.content_type->value.data, "application/x-www-form-urlencoded", sizeof("application/x-www-form-urlencoded") - 1) == 0) {
-      ctx->query.len += sizeof("\"\":{}") - 1;
-      for(start = r->request_body->buf->pos, end = r->request_body->buf->last; start < end; start++) {
-        ctx->query.len++;
-        if (*start == '\'' || *start == '"') {
-          ctx->query.len++;
-        } else if (*start == '&') {
-          ctx->query.len += sizeof("\"\":\"\" ") - 1;
-        }
-      }
-    } else {
-      ctx->query.len += sizeof("\"\":{}") - 1;
-      for(start = r->request_body->buf->pos, end = r->request_body->buf->last; start < end; start++) {
-        ctx->query.len++;
-        if (*start == '\'' || *start == '"') {
-          ctx->query.len++;
-        }
-      }
-    }
+  if (ctx->function != NULL) {
+    ctx->query.len += ctx->function->len;
+  } else if (alcf->route.len == 0) {
+    ctx->query.len += r->uri.len + sizeof("index") - 1;
+  } else {
+    // route function name and uri parameter
+    ctx->query.len += alcf->route.len + r->uri.len + 1;
   }
 
-  ctx->query.len += sizeof("\"\":{}") - 1;
+  // cookies parameter
+  ctx->query.len += sizeof("{}");
   ngx_table_elt_t  **h;
   h = r->headers_in.cookies.elts;
   for(i = 0; i < r->headers_in.cookies.nelts; i++) {
+    ctx->query.len += sizeof(",\"\":\"\"") - 1; 
     for(start = end = h[i]->value.data, end += h[i]->value.len; start < end; start++) {
       ctx->query.len++;
-      if (*start == '\'' || *start == '"') {
+      if (*start == '"' || *start == '\\') {
         ctx->query.len++;
       } else if (*start == ';') {
-        ctx->query.len += sizeof("\"\":\"\" ") - 1; 
+        ctx->query.len += sizeof(",\"\":\"\"") - 1; 
       }
     }
   }
+
+  // args parameter
+  ctx->query.len += sizeof("{}");
+  ctx->query.len += c2h5oh_args_json_len((const char *)r->args.data, 
+                                         (const char *)r->args.data + r->args.len);
+  if (ctx->body.len && r->headers_in.content_type && !ctx->body_json &&
+      !ctx->body_raw && ngx_c2h5oh_body_is_form(r)) 
+  {
+    ctx->query.len += c2h5oh_args_json_len((const char *)ctx->body.data,
+                                           (const char *)ctx->body.data + ctx->body.len);
+  }
+
+  // method parameter
+  ctx->query.len += r->method_name.len + 1;
 }
 
 //-----------------------------------------------------------------------------
+// parses json to ngx_c2h5oh_js_tokens, returns tokens count, -1 on error
 static int
-ngx_c2h5oh_init_query_data(ngx_http_request_t *r, ngx_c2h5oh_ctx_t * ctx) {
-  ngx_uint_t i;
-  ngx_table_elt_t  **h;
-  ngx_c2h5oh_loc_conf_t * alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
-  h = r->headers_in.cookies.elts;
-
-  ngx_c2h5oh_query_data_set_len(r, ctx);
-  ctx->query.data = ngx_palloc(r->pool, ctx->query.len);
-  ctx->query.len = 0;
-  ngx_memcpy(ctx->query.data, k_ngx_c2h5oh_select, sizeof(k_ngx_c2h5oh_select));//}', '{}')");
-  ctx->query.len = sizeof(k_ngx_c2h5oh_select) - 1; 
-  if (alcf->route.len == 0) {
-    u_char * p = r->uri.data + 1 + alcf->root.len;
-    if (r->uri.len == 1) {
-      ngx_memcpy(ctx->query.data + ctx->query.len, "index", sizeof("index") - 1);
-    } else {
-      while(p < r->uri.data + r->uri.len) {
-        if ((*p >= 0x30 && *p <= 0x39) || (*p >= 0x61 && *p <= 0x7a)) {
-          *(ctx->query.data + ctx->query.len++) = *p;
-        } else if (*p >= 0x41 && *p <= 0x5a) {
-          *(ctx->query.data + ctx->query.len++) = *p + 0x20;
-        } else if (*p == '/') {
-          *(ctx->query.data + ctx->query.len++) = '_';
-        }
-        p++;
-      }
-      if (*(ctx->query.data + ctx->query.len - 1) == '_') {
-        ctx->query.len--; 
-      }
-    }
-    strcpy((char *)ctx->query.data + ctx->query.len, "('{");
-    ctx->query.len += sizeof("('{") - 1; 
+ngx_c2h5oh_json_parse(ngx_http_request_t * r, u_char * data, size_t len)
+{
+  int js = JSMN_ERROR_NOMEM;
 
-  } else {
-    ngx_memcpy(ctx->query.data + ctx->query.len, alcf->route.data, alcf->route.len);
-    ctx->query.len += alcf->route.len;
+  jsmn_init(&ngx_c2h5oh_jsmn_parser);
 
-    strcpy((char *)ctx->query.data + ctx->query.len, "('");
-    ctx->query.len += sizeof("('") - 1; 
-    u_char * p = r->uri.data + alcf->root.len;
-    while(p < r->uri.data + r->uri.len) {
-      *(ctx->query.data + ctx->query.len++) = *p;
-      if (*p == '\'') {
-        *(ctx->query.data + ctx->query.len++) = *p;
+  while(js == JSMN_ERROR_NOMEM) {
+    js = jsmn_parse(&ngx_c2h5oh_jsmn_parser, (char *)data, len, 
+                    ngx_c2h5oh_js_tokens, ngx_c2h5oh_js_tokens_count);
+    if (js < -1) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[c2h5oh] json parse error: invalid json string");
+      return -1;
+    } else if (js == JSMN_ERROR_NOMEM) {
+      ngx_c2h5oh_js_tokens_count *= 3; ngx_c2h5oh_js_tokens_count /= 2;
+      void * p = realloc(ngx_c2h5oh_js_tokens, 
+                         sizeof(jsmntok_t) * ngx_c2h5oh_js_tokens_count);
+      if (p == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[c2h5oh] error allocating ngx_c2h5oh_js_tokens");
+        return -1;
+      } else {
+        ngx_c2h5oh_js_tokens = p;
       }
-      p++;
+    } else if (js == 0) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[c2h5oh] json parse error: empty json");
+      return -1;
     }
-    *(ctx->query.data + ctx->query.len++) = '\'';
-    *(ctx->query.data + ctx->query.len++) = ',';
-    *(ctx->query.data + ctx->query.len++) = '\'';
-    *(ctx->query.data + ctx->query.len++) = '{';
   }
+  return js;
+}
 
-  u_char * cookies_start = ctx->query.data + ctx->query.len;
-  for(i = 0; i < r->headers_in.cookies.nelts; i++) {
-    ngx_c2h5oh_parse_cookies(&ctx->query, &h[i]->value, cookies_start);
-  }
-  ngx_memcpy(ctx->query.data + ctx->query.len, "}','{", 5);
-  ctx->query.len += sizeof("}','{") - 1; 
-  u_char * args_start = ctx->query.data + ctx->query.len;
-  if (ngx_http_arg(r, (u_char*)"callback", sizeof("callback") - 1, &ctx->callback) != NGX_OK) {
-    ctx->callback.len = 0;
+//-----------------------------------------------------------------------------
+// returns token next to t value with all its nested tokens
+static jsmntok_t *
+ngx_c2h5oh_json_skip(jsmntok_t * t, jsmntok_t * end)
+{
+  jsmntok_t * next = t + 1;
+  while(next < end && next->start < t->end) {
+    next++;
   }
-  if (ngx_c2h5oh_parse_args(r, &ctx->query, r->args.data, r->args.data + r->args.len, args_start) != 0) {
-    return -1;
+  return next;
+}
+
+//-----------------------------------------------------------------------------
+// batch body is json array of {"route":"/path/","args":{...}} items, each
+// item is a route function call with own uri and args and request cookies
+static int
+ngx_c2h5oh_init_batch_data(ngx_http_request_t *r, ngx_c2h5oh_ctx_t * ctx)
+{
+  int          i, j, n, size;
+  jsmntok_t  * t;
+  jsmntok_t  * k;
+  jsmntok_t  * end;
+  u_char     * p;
+  const char **v;
+
+  n = ngx_c2h5oh_json_parse(r, ctx->body.data, ctx->body.len);
+  if (n <= 0) {
+    return -1;
   }
-  if (r->request_body && r->request_body->buf && r->headers_in.content_type && r->request_body_in_single_buf) {
-    if (r->request_body_in_single_buf) {
-      if (ngx_memcmp(r->headers_in.content_type->value.data, "application/x-www-form-urlencoded", sizeof("application/x-www-form-urlencoded") - 1) == 0) {
-        if (r->request_body->buf) {
-          if (ngx_c2h5oh_parse_args(r, &ctx->query, r->request_body->buf->pos, r->request_body->buf->last, args_start) != 0) {
-            return -1;
-          }
-        } else {
-          ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                        "[c2h5oh] request_body is null");
-        }
-      } else {
-        // TODO: pass whole body as parameter
+  t   = ngx_c2h5oh_js_tokens;
+  end = t + n;
+  if (t->type != JSMN_ARRAY || t->size == 0 || t->size > NGX_C2H5OH_MAX_BATCH) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] batch has to be array of 1..%d items", 
+                  NGX_C2H5OH_MAX_BATCH);
+    return -1;
+  }
+
+  ctx->batch = t->size;
+  ctx->batch_values = ngx_palloc(r->pool, ctx->batch * 3 * sizeof(char *));
+  p = ngx_pnalloc(r->pool, ctx->body.len + ctx->batch * 2);
+  if (ctx->batch_values == NULL || p == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] allocation error");
+    return -1;
+  }
+
+  t++;
+  for(i = 0; i < (int)ctx->batch; i++) {
+    if (t >= end || t->type != JSMN_OBJECT) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[c2h5oh] batch item has to be an object");
+      return -1;
+    }
+    v    = ctx->batch_values + i * 3;
+    v[0] = NULL;
+    v[1] = ctx->param_values[1]; // request cookies
+    v[2] = "{}";
+    size = t->size;
+    t++;
+    for(j = 0; j < size && t + 1 < end; j++) {
+      k = t++;
+      if (NGX_C2H5OH_JSON_KEY_IS(ctx->body.data, k, "route") && 
+          t->type == JSMN_STRING) 
+      {
+        v[0] = (const char *)p;
+        p = ngx_cpymem(p, ctx->body.data + t->start, t->end - t->start);
+        *p++ = '\0';
+      } else if (NGX_C2H5OH_JSON_KEY_IS(ctx->body.data, k, "args") && 
+                 t->type == JSMN_OBJECT) 
+      {
+        v[2] = (const char *)p;
+        p = ngx_cpymem(p, ctx->body.data + t->start, t->end - t->start);
+        *p++ = '\0';
       }
-    } else {
+      t = ngx_c2h5oh_json_skip(t, end);
+    }
+    if (v[0] == NULL) {
       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[c2h5oh] request_body not in single buf");
+                    "[c2h5oh] batch item route is not specified");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// c2h5oh_set settings are set by set_config local to query transaction, 
+// in the same round trip with query, setting values are part of cache key
+static int
+ngx_c2h5oh_init_preamble(ngx_http_request_t *r, ngx_c2h5oh_ctx_t * ctx)
+{
+  ngx_uint_t              i;
+  ngx_uint_t              n;
+  ngx_str_t               values[NGX_C2H5OH_MAX_SETTINGS];
+  size_t                  len;
+  u_char                * p;
+  ngx_c2h5oh_setting_t  * s;
+  ngx_c2h5oh_loc_conf_t * alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
+
+  n = alcf->settings != NULL ? alcf->settings->nelts : 0;
+  if (n == 0 && !alcf->statement_timeout) {
+    return 0;
+  }
+
+  s   = n ? alcf->settings->elts : NULL;
+  len = sizeof(k_ngx_c2h5oh_select) + ctx->key.len + 
+        sizeof(k_ngx_c2h5oh_statement_timeout);
+  for(i = 0; i < n; i++) {
+    if (ngx_http_complex_value(r, &s[i].value, &values[i]) != NGX_OK) {
+      return -1;
     }
+    len += values[i].len + 1 + sizeof("set_config($00::text,$00::text,true),");
+  }
+  p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] allocation error");
+    return -1;
   }
-  // TODO
-  ngx_memcpy(ctx->query.data + ctx->query.len, "}');", sizeof("}');"));
-  ctx->query.len += sizeof("}');"); 
+
+  // cache key is followed by setting values, remaining time is not a part 
+  // of it, it is set by ngx_c2h5oh_query
+  if (ctx->key.len) {
+    u_char * key = p;
+    p = ngx_cpymem(p, ctx->key.data, ctx->key.len);
+    ctx->key.data = key;
+  }
+  ctx->preamble_nparams  = 0;
+  ctx->statement_timeout = alcf->statement_timeout;
+  if (ctx->statement_timeout) {
+    ctx->preamble_values[ctx->preamble_nparams++] = 
+      (const char *)ctx->statement_timeout_value;
+  }
+  for(i = 0; i < n; i++) {
+    ctx->preamble_values[ctx->preamble_nparams++] = (const char *)s[i].name.data;
+    ctx->preamble_values[ctx->preamble_nparams++] = (const char *)p;
+    p = ngx_cpymem(p, values[i].data, values[i].len);
+    *p++ = '\0';
+  }
+  if (ctx->key.len) {
+    ctx->key.len = p - ctx->key.data;
+  }
+
+  ctx->preamble.data = p;
+  p = ngx_cpymem(p, k_ngx_c2h5oh_select, sizeof(k_ngx_c2h5oh_select) - 1);
+  if (ctx->statement_timeout) {
+    p = ngx_cpymem(p, k_ngx_c2h5oh_statement_timeout, 
+                   sizeof(k_ngx_c2h5oh_statement_timeout) - 1);
+  }
+  for(i = 0; i < n; i++) {
+    p = ngx_sprintf(p, "%sset_config($%ui::text,$%ui::text,true)", 
+                    i || ctx->statement_timeout ? "," : "", 
+                    ctx->statement_timeout + i * 2 + 1, 
+                    ctx->statement_timeout + i * 2 + 2);
+  }
+  p = ngx_cpymem(p, ";", sizeof(";"));
+  ctx->preamble.len = p - ctx->preamble.data - 1;
 
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+static int
+ngx_c2h5oh_init_query_data(ngx_http_request_t *r, ngx_c2h5oh_ctx_t * ctx) {
+  ngx_uint_t i;
+  ngx_uint_t n;
+  ngx_str_t  json;
+  u_char   * p;
+  ngx_table_elt_t  **h;
+  ngx_c2h5oh_loc_conf_t * alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
+  h = r->headers_in.cookies.elts;
+
+  // json body is passed as is, it is not copied, routes of locations 
+  // without c2h5oh_json_body don't get it as before
+  ctx->body_json = ctx->body.len && alcf->json_body && !alcf->batch && 
+                   !ctx->body_raw &&
+                   NGX_C2H5OH_CONTENT_TYPE_IS(r, "application/json");
+
+  ngx_c2h5oh_query_data_set_len(r, ctx);
+  ctx->query.data = ngx_pnalloc(r->pool, ctx->query.len);
+  if (ctx->query.data == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] allocation error");
+    return -1;
+  }
+
+  // query text, all values are passed as parameters --------------------------
+  p = ctx->query.data;
+  if (alcf->copy_out) {
+    // function rows are streamed to client as COPY TO STDOUT data
+    ctx->copy = alcf->copy_out;
+    p = ngx_cpymem(p, k_ngx_c2h5oh_copy, sizeof(k_ngx_c2h5oh_copy) - 1);
+  }
+  p = ngx_cpymem(p, k_ngx_c2h5oh_select, sizeof(k_ngx_c2h5oh_select) - 1);
+  if (alcf->rows) {
+    // function rows are serialized to json by module
+    ctx->rows = 1;
+    p = ngx_cpymem(p, k_ngx_c2h5oh_from, sizeof(k_ngx_c2h5oh_from) - 1);
+  } else if (ctx->copy) {
+    p = ngx_cpymem(p, k_ngx_c2h5oh_from, sizeof(k_ngx_c2h5oh_from) - 1);
+  }
+  if (ctx->function != NULL) {
+    // mapped route, function is called directly by prepared statement
+    p = ngx_cpymem(p, ctx->function->data, ctx->function->len);
+    ctx->prepared = 1;
+  } else if (alcf->route.len == 0) {
+    p = ngx_cpymem(p, k_ngx_c2h5oh_schema, sizeof(k_ngx_c2h5oh_schema) - 1);
+    u_char * name = p;
+    u_char * s = r->uri.data + 1 + alcf->root.len;
+    while(s < r->uri.data + r->uri.len) {
+      if ((*s >= 0x30 && *s <= 0x39) || (*s >= 0x61 && *s <= 0x7a)) {
+        *p++ = *s;
+      } else if (*s >= 0x41 && *s <= 0x5a) {
+        *p++ = *s + 0x20;
+      } else if (*s == '/') {
+        *p++ = '_';
+      }
+      s++;
+    }
+    if (p > name && *(p - 1) == '_') {
+      p--;
+    }
+    if (p == name) {
+      p = ngx_cpymem(p, "index", sizeof("index") - 1);
+    }
+  } else {
+    // route function is prepared once, uri is passed as parameter
+    p = ngx_cpymem(p, k_ngx_c2h5oh_schema, sizeof(k_ngx_c2h5oh_schema) - 1);
+    p = ngx_cpymem(p, alcf->route.data, alcf->route.len);
+    ctx->prepared = 1;
+  }
+  n = 0;
+  *p++ = '(';
+  if (ctx->function == NULL && alcf->route.len) {
+    p = ngx_sprintf(p, "$%ui::varchar,", ++n);
+  }
+  p = ngx_sprintf(p, "$%ui::jsonb,", ++n);
+  p = ngx_sprintf(p, "$%ui::jsonb", ++n);
+  if (ctx->body_json) {
+    p = ngx_sprintf(p, ",b=>$%ui::json::jsonb", ++n);
+  }
+  if (ctx->upload.len) {
+    p = ngx_sprintf(p, ",f=>$%ui::jsonb", ++n);
+  }
+  if (alcf->methods & NGX_CONF_BITMASK_SET && !alcf->batch) {
+    p = ngx_sprintf(p, ",m=>$%ui::varchar", ++n);
+  }
+  *p++ = ')';
+  if (ctx->copy == NGX_C2H5OH_COPY_CSV) {
+    p = ngx_cpymem(p, k_ngx_c2h5oh_copy_csv, sizeof(k_ngx_c2h5oh_copy_csv) - 1);
+  } else if (ctx->copy == NGX_C2H5OH_COPY_TEXT) {
+    p = ngx_cpymem(p, k_ngx_c2h5oh_copy_text, sizeof(k_ngx_c2h5oh_copy_text) - 1);
+  }
+  p = ngx_cpymem(p, ";", sizeof(";"));
+  ctx->query.len = p - ctx->query.data - 1;
+  ctx->nparams = 0;
+
+  // uri ----------------------------------------------------------------------
+  if (ctx->function == NULL && alcf->route.len) {
+    ctx->param_values[ctx->nparams++] = (const char *)p;
+    p = ngx_cpymem(p, r->uri.data + alcf->root.len, r->uri.len - alcf->root.len);
+    *p++ = '\0';
+  }
+
+  // cookies ------------------------------------------------------------------
+  ctx->param_values[ctx->nparams++] = (const char *)p;
+  *p++ = '{';
+  json.data = ctx->query.data;
+  json.len  = p - json.data;
+  for(i = 0; i < r->headers_in.cookies.nelts; i++) {
+    ngx_c2h5oh_parse_cookies(&json, &h[i]->value, p);
+  }
+  p = json.data + json.len;
+  *p++ = '}';
+  *p++ = '\0';
+
+  // args ---------------------------------------------------------------------
+  ctx->param_values[ctx->nparams++] = (const char *)p;
+  *p++ = '{';
+  json.len  = p - json.data;
+  if (ngx_http_arg(r, (u_char*)"callback", sizeof("callback") - 1, &ctx->callback) != NGX_OK) {
+    ctx->callback.len = 0;
+  }
+  if (ngx_c2h5oh_parse_args(r, &json, r->args.data, r->args.data + r->args.len, p) != 0) {
+    return -1;
+  }
+  if (ctx->body.len && r->headers_in.content_type && !ctx->body_json &&
+      !ctx->body_raw && ngx_c2h5oh_body_is_form(r)) 
+  {
+    if (ngx_c2h5oh_parse_args(r, &json, ctx->body.data, ctx->body.data + ctx->body.len, p) != 0) {
+      return -1;
+    }
+  }
+  p = json.data + json.len;
+  *p++ = '}';
+  *p++ = '\0';
+
+  // json body is sent as binary parameter without copying and null terminator
+  if (ctx->body_json) {
+    ctx->param_values[ctx->nparams]  = (const char *)ctx->body.data;
+    ctx->param_lengths[ctx->nparams] = ctx->body.len;
+    ctx->param_formats[ctx->nparams] = 1;
+    ctx->nparams++;
+  }
+
+  // uploaded file metadata is passed without copying
+  if (ctx->upload.len) {
+    ctx->param_values[ctx->nparams++] = (const char *)ctx->upload.data;
+  }
+
+  // method, HEAD is answered as GET without body ----------------------------
+  if (alcf->methods & NGX_CONF_BITMASK_SET && !alcf->batch) {
+    ctx->param_values[ctx->nparams++] = (const char *)p;
+    p = ngx_cpymem(p, r->method & NGX_HTTP_HEAD ? k_ngx_c2h5oh_get.data 
+                                                : r->method_name.data,
+                   r->method & NGX_HTTP_HEAD ? k_ngx_c2h5oh_get.len 
+                                             : r->method_name.len);
+    *p++ = '\0';
+  }
+
+  // GET and HEAD results may be cached, query text and parameters are the key
+  if (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD) && !ctx->copy && 
+      !ctx->auth_key.len) 
+  {
+    ctx->key.data = ctx->query.data;
+    ctx->key.len  = p - ctx->query.data;
+  }
+
+  if (alcf->batch && ngx_c2h5oh_init_batch_data(r, ctx) != 0) {
+    return -1;
+  }
+
+  return ngx_c2h5oh_init_preamble(r, ctx);
+}
+
+//-----------------------------------------------------------------------------
+static int
+ngx_c2h5oh_query(ngx_c2h5oh_ctx_t * ctx, c2h5oh_t * conn)
+{
+  ngx_time_t * tp;
+  ngx_msec_int_t remaining;
+
+  if (ctx->statement_timeout) {
+    // database aborts the query at the request deadline
+    tp = ngx_timeofday();
+    remaining = (ngx_msec_int_t)(ctx->timeout.sec - tp->sec) * 1000 + 
+                (ngx_msec_int_t)ctx->timeout.msec - (ngx_msec_int_t)tp->msec;
+    ngx_sprintf(ctx->statement_timeout_value, "%i%Z", 
+                (ngx_int_t)ngx_max(remaining, 1));
+  }
+  if (conn == ctx->conn) {
+    ctx->query_start = ngx_current_msec;
+  } else if (conn == ctx->hedge) {
+    ctx->hedge_start = ngx_current_msec;
+  }
+  if (ctx->copy_in_state == NGX_C2H5OH_COPY_IN_START) {
+    // request body is sent as copy data, then route function is called
+    return c2h5oh_query_copy(conn, (const char *)ctx->copy_in->data, 
+                             0, NULL, NULL, NULL);
+  }
+  if (ctx->copy) {
+    // copy is sent as simple query, settings are not applied
+    return c2h5oh_query_copy(conn, (const char *)ctx->query.data, 
+                             ctx->nparams, ctx->param_values, 
+                             ctx->param_lengths, ctx->param_formats);
+  }
+  if (ctx->preamble.len) {
+    c2h5oh_preamble(conn, (const char *)ctx->preamble.data, 
+                    ctx->preamble_nparams, ctx->preamble_values);
+  }
+  if (ctx->rows) {
+    c2h5oh_rows(conn);
+  }
+  if (ctx->batch) {
+    return c2h5oh_query_batch(conn, (const char *)ctx->query.data, 
+                              ctx->batch, 3, ctx->batch_values, NULL, NULL);
+  }
+  if (ctx->prepared) {
+    return c2h5oh_query_prepared(conn, (const char *)ctx->query.data, 
+                                 ctx->nparams, ctx->param_values, 
+                                 ctx->param_lengths, ctx->param_formats);
+  }
+  return c2h5oh_query_params(conn, (const char *)ctx->query.data, 
+                             ctx->nparams, ctx->param_values, 
+                             ctx->param_lengths, ctx->param_formats);
+}
+
+//-----------------------------------------------------------------------------
+// takes free connection, reports time request waited for it to the pool
+static c2h5oh_t *
+ngx_c2h5oh_acquire(ngx_c2h5oh_ctx_t * ctx)
+{
+  ctx->conn = c2h5oh_create_class(ctx->priority);
+  if (ctx->conn == NULL) {
+    if (!ctx->waiting) {
+      ctx->waiting    = 1;
+      ctx->wait_start = ngx_current_msec;
+      c2h5oh_wait_class(ctx->priority, 1);
+    }
+  } else if (ctx->waiting) {
+    ctx->waiting = 0;
+    c2h5oh_wait_class(ctx->priority, 0);
+    c2h5oh_report_wait(ngx_current_msec - ctx->wait_start, 1);
+  } else {
+    c2h5oh_report_wait(0, 0);
+  }
+  return ctx->conn;
+}
+
+//-----------------------------------------------------------------------------
+// sends request body as COPY FROM STDIN data, route function query is sent 
+// on the same connection when copy is done, returns 1 if copy is failed
+static int
+ngx_c2h5oh_copy_in(ngx_c2h5oh_ctx_t * ctx)
+{
+  size_t len;
+  int    rc = 1;
+
+  switch(ctx->copy_in_state) {
+    case NGX_C2H5OH_COPY_IN_START:
+      if (c2h5oh_poll(ctx->conn) == 0) {
+        return 0;
+      }
+      if (!c2h5oh_is_copy(ctx->conn)) {
+        return 1;
+      }
+      ctx->copy_in_state = NGX_C2H5OH_COPY_IN_SEND;
+      /* fall through */
+    case NGX_C2H5OH_COPY_IN_SEND:
+      // body is sent by chunks until database doesn't take more
+      while(ctx->copy_in_sent < ctx->body.len) {
+        len = ngx_min(ctx->body.len - ctx->copy_in_sent, 
+                      NGX_C2H5OH_COPY_BUF_SIZE);
+        rc = c2h5oh_copy_put(ctx->conn, 
+                             (const char *)ctx->body.data + ctx->copy_in_sent,
+                             (int)len);
+        if (rc == 0) {
+          return 0;
+        }
+        if (rc < 0) {
+          break;
+        }
+        ctx->copy_in_sent += len;
+      }
+      if (rc > 0 && c2h5oh_copy_end(ctx->conn) == 0) {
+        return 0;
+      }
+      ctx->copy_in_state = NGX_C2H5OH_COPY_IN_END;
+      /* fall through */
+    case NGX_C2H5OH_COPY_IN_END:
+      if (c2h5oh_poll(ctx->conn) == 0) {
+        return 0;
+      }
+      if (c2h5oh_is_error(ctx->conn)) {
+        return 1;
+      }
+  }
+  ctx->copy_in_state = 0;
+  return ngx_c2h5oh_query(ctx, ctx->conn) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// polls query, slow query is hedged on replica and the first result is taken
+static int
+ngx_c2h5oh_poll(ngx_c2h5oh_ctx_t * ctx)
+{
+  c2h5oh_t * loser;
+  unsigned   delay;
+
+  if (ctx->copy_in_state) {
+    return ngx_c2h5oh_copy_in(ctx);
+  }
+
+  // latency of the query answered, hedge delay is not counted
+  if (c2h5oh_poll(ctx->conn)) {
+    if (ctx->latency != NULL) {
+      c2h5oh_report_latency(ctx->latency, ngx_current_msec - ctx->query_start);
+    }
+    loser = ctx->hedge;
+  } else if (ctx->hedge != NULL && c2h5oh_poll(ctx->hedge)) {
+    c2h5oh_report_latency(ctx->latency, ngx_current_msec - ctx->hedge_start);
+    loser      = ctx->conn;
+    ctx->conn  = ctx->hedge;
+  } else {
+    delay = ctx->hedging && ctx->hedge == NULL ? 
+            c2h5oh_hedge_delay(ctx->latency) : 0;
+    if (delay && ngx_current_msec - ctx->query_start >= delay) {
+      ctx->hedge = c2h5oh_create_hedge();
+      if (ctx->hedge != NULL && ngx_c2h5oh_query(ctx, ctx->hedge) != 0) {
+        c2h5oh_free(ctx->hedge);
+        ctx->hedge   = NULL;
+        ctx->hedging = 0;
+      }
+    }
+    return 0;
+  }
+
+  // slower query is canceled
+  ctx->hedge = NULL;
+  if (loser != NULL) {
+    c2h5oh_free(loser);
+    ngx_c2h5oh_drain();
+  }
+  return 1;
+}
+
 //-----------------------------------------------------------------------------
 ngx_int_t 
 ngx_c2h5oh_init_request(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx) 
@@ -440,22 +1331,23 @@ ngx_c2h5oh_init_request(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
     }
     cln->handler = ngx_c2h5oh_cleanup;
     cln->data    = ctx;
+    // client close finalizes request, cleanup cancels query
+    r->read_event_handler = ngx_http_test_reading;
 
-    ctx->conn = c2h5oh_create();
-    if (ctx->conn == NULL) {
+    if (ngx_c2h5oh_acquire(ctx) == NULL) {
       ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
       r->main->count++;
       return NGX_DONE;
     }
 
-    if (c2h5oh_query(ctx->conn, (const char *)ctx->query.data) != 0) {
+    if (ngx_c2h5oh_query(ctx, ctx->conn) != 0) {
       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                     "[c2h5oh] error create query");
       return NGX_ERROR;
     }
   }
 
-  if (c2h5oh_poll(ctx->conn) == 0) {
+  if (ngx_c2h5oh_poll(ctx) == 0) {
     ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
     r->main->count++;
     return NGX_DONE;
@@ -465,33 +1357,165 @@ ngx_c2h5oh_init_request(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
   return NGX_DONE;
 }
 
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_body_unmap(void * data)
+{
+  ngx_str_t * body = data;
+
+  munmap(body->data, body->len);
+}
+
+//-----------------------------------------------------------------------------
+static ngx_int_t
+ngx_c2h5oh_body_init(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
+{
+  ngx_chain_t        * cl;
+  ngx_temp_file_t    * tf;
+  ngx_pool_cleanup_t * cln;
+  u_char             * p;
+  size_t               len;
+
+  tf = r->request_body->temp_file;
+  if (tf != NULL) {
+    // body is spooled to temp file, whole file is in single buffer
+    if (tf->file.offset == 0) {
+      return NGX_OK;
+    }
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+      return NGX_ERROR;
+    }
+    p = mmap(NULL, tf->file.offset, PROT_READ, MAP_PRIVATE, tf->file.fd, 0);
+    if (p == MAP_FAILED) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                    "[c2h5oh] mmap \"%V\" failed", &tf->file.name);
+      return NGX_ERROR;
+    }
+    ctx->body.data = p;
+    ctx->body.len  = tf->file.offset;
+    cln->handler = ngx_c2h5oh_body_unmap;
+    cln->data    = &ctx->body;
+    return NGX_OK;
+  }
+
+  cl = r->request_body->bufs;
+  if (cl->next == NULL) {
+    ctx->body.data = cl->buf->pos;
+    ctx->body.len  = cl->buf->last - cl->buf->pos;
+    return NGX_OK;
+  }
+
+  // several buffers, compute total length and copy once
+  for(len = 0; cl != NULL; cl = cl->next) {
+    len += cl->buf->last - cl->buf->pos;
+  }
+  p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] allocation error");
+    return NGX_ERROR;
+  }
+  ctx->body.data = p;
+  ctx->body.len  = len;
+  for(cl = r->request_body->bufs; cl != NULL; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+  return NGX_OK;
+}
+
+//-----------------------------------------------------------------------------
+// uploaded file is removed unless route function accepted it
+static void
+ngx_c2h5oh_upload_cleanup(void * data)
+{
+  ngx_http_request_t * r = data;
+  ngx_temp_file_t    * tf = r->request_body->temp_file;
+
+  if (r->headers_out.status >= NGX_HTTP_OK && 
+      r->headers_out.status < NGX_HTTP_SPECIAL_RESPONSE) 
+  {
+    return;
+  }
+  if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                  ngx_delete_file_n " \"%V\" failed", &tf->file.name);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// body is kept in client_body_temp_path file, route function gets its path, 
+// name, size and md5 as json
+static ngx_int_t
+ngx_c2h5oh_upload_init(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
+{
+  ngx_temp_file_t    * tf;
+  ngx_pool_cleanup_t * cln;
+  ngx_str_t          * path;
+  ngx_md5_t            md5;
+  u_char               hash[16];
+  u_char             * name;
+  u_char             * p;
+  size_t               len;
+
+  tf = r->request_body != NULL ? r->request_body->temp_file : NULL;
+  if (tf == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] upload is not stored to file");
+    return NGX_ERROR;
+  }
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    return NGX_ERROR;
+  }
+  cln->handler = ngx_c2h5oh_upload_cleanup;
+  cln->data    = r;
+
+  // body file is mapped already
+  ngx_md5_init(&md5);
+  ngx_md5_update(&md5, ctx->body.data, ctx->body.len);
+  ngx_md5_final(hash, &md5);
+
+  path = &tf->file.name;
+  for(name = path->data + path->len; name > path->data && *(name - 1) != '/'; 
+      name--) { }
+
+  len = sizeof("{\"path\":\"\",\"name\":\"\",\"size\":,\"md5\":\"\"}") + 
+        (path->len + ngx_escape_json(NULL, path->data, path->len)) * 2 + 
+        NGX_OFF_T_LEN + 32;
+  p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+  ctx->upload.data = p;
+  p = ngx_cpymem(p, "{\"path\":\"", sizeof("{\"path\":\"") - 1);
+  p = (u_char *)ngx_escape_json(p, path->data, path->len);
+  p = ngx_cpymem(p, "\",\"name\":\"", sizeof("\",\"name\":\"") - 1);
+  p = (u_char *)ngx_escape_json(p, name, path->data + path->len - name);
+  p = ngx_sprintf(p, "\",\"size\":%O,\"md5\":\"", tf->file.offset);
+  p = ngx_hex_dump(p, hash, sizeof(hash));
+  p = ngx_cpymem(p, "\"}", sizeof("\"}"));
+  ctx->upload.len = p - ctx->upload.data - 1;
+  return NGX_OK;
+}
+
 //-----------------------------------------------------------------------------
 static void
 ngx_c2h5oh_post_handler(ngx_http_request_t *r) 
 {
   ngx_c2h5oh_ctx_t* ctx;
-  ngx_chain_t*      cl;
+  ngx_c2h5oh_loc_conf_t * alcf;
 
   r->main->count--;
 
-  ctx = ngx_http_get_module_ctx(r, ngx_c2h5oh_module);
+  ctx  = ngx_http_get_module_ctx(r, ngx_c2h5oh_module);
+  alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
 
   if (r->request_body != NULL && ctx != NULL) {
-    cl  = r->request_body->bufs;
-    if (cl != NULL) {
-      while(cl != NULL) {
-        if (cl == r->request_body->bufs) {
-          r->request_body->buf = cl->buf;
-        } else {
-          size_t old_len  = r->request_body->buf->last - r->request_body->buf->pos;
-          size_t next_len = cl->buf->last - cl->buf->pos;
-          ngx_buf_t * buf = ngx_create_temp_buf(r->pool, old_len + next_len);
-          ngx_memcpy(buf->pos, r->request_body->buf->pos, old_len);
-          ngx_memcpy(buf->pos + old_len, cl->buf->pos, next_len);
-          buf->last = buf->pos + old_len + next_len;
-          r->request_body->buf = buf;
-        }
-        cl = cl->next;
+    if (r->request_body->bufs != NULL) {
+      if (ngx_c2h5oh_body_init(r, ctx) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
       }
     } else {
       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -501,12 +1525,291 @@ ngx_c2h5oh_post_handler(ngx_http_request_t *r)
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "[c2h5oh] null request body");
   }
+  if (ctx != NULL && alcf->upload && ngx_c2h5oh_upload_init(r, ctx) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
   ngx_int_t res = ngx_c2h5oh_init_request(r, ctx);
   if (res != NGX_DONE) {
     ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
   }
 }
 
+//-----------------------------------------------------------------------------
+// decisions of a session in all locations have the same hash of session key
+static uint32_t
+ngx_c2h5oh_auth_hash(ngx_str_t * key)
+{
+  size_t n;
+
+  for(n = 0; n < key->len && key->data[n] != '\0'; n++) { /* void */ }
+  return ngx_crc32_short(key->data, n);
+}
+
+//-----------------------------------------------------------------------------
+// finds decision of session in any location, NULL if there is no one
+static ngx_c2h5oh_auth_node_t *
+ngx_c2h5oh_auth_find_session(ngx_rbtree_node_t * node, 
+                             ngx_rbtree_node_t * sentinel, uint32_t hash, 
+                             ngx_str_t * key)
+{
+  ngx_c2h5oh_auth_node_t * an;
+
+  while(node != sentinel) {
+    if (hash != node->key) {
+      node = hash < node->key ? node->left : node->right;
+      continue;
+    }
+    // nodes of equal hash are ordered by key, both subtrees are searched
+    an = (ngx_c2h5oh_auth_node_t *)node;
+    if (an->sn.str.len > key->len && an->data[key->len] == '\0' &&
+        ngx_memcmp(an->data, key->data, key->len) == 0) 
+    {
+      return an;
+    }
+    an = ngx_c2h5oh_auth_find_session(node->left, sentinel, hash, key);
+    if (an != NULL) {
+      return an;
+    }
+    node = node->right;
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_auth_delete(ngx_c2h5oh_auth_cache_t * cache, 
+                       ngx_c2h5oh_auth_node_t * node)
+{
+  ngx_queue_remove(&node->queue);
+  ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+  ngx_slab_free_locked(cache->shpool, node);
+}
+
+//-----------------------------------------------------------------------------
+// returns cached auth decision status, NGX_DECLINED if not cached
+static ngx_int_t
+ngx_c2h5oh_auth_get(ngx_c2h5oh_auth_cache_t * cache, ngx_str_t * key)
+{
+  ngx_c2h5oh_auth_node_t * node;
+  ngx_int_t                status = NGX_DECLINED;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  node = (ngx_c2h5oh_auth_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree,
+           key, ngx_c2h5oh_auth_hash(key));
+  if (node != NULL) {
+    if (node->expires > ngx_time() && 
+        node->generation == cache->sh->generation) 
+    {
+      status = node->status;
+      ngx_queue_remove(&node->queue);
+      ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+    } else {
+      ngx_c2h5oh_auth_delete(cache, node);
+    }
+  }
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return status;
+}
+
+//-----------------------------------------------------------------------------
+// stores auth decision, least recently used ones are evicted if cache is full
+static void
+ngx_c2h5oh_auth_put(ngx_c2h5oh_auth_cache_t * cache, ngx_str_t * key, 
+                    ngx_uint_t status, time_t ttl)
+{
+  ngx_c2h5oh_auth_node_t * node;
+  ngx_uint_t               i;
+  uint32_t                 hash = ngx_c2h5oh_auth_hash(key);
+  time_t                   now  = ngx_time();
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  node = (ngx_c2h5oh_auth_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree,
+           key, hash);
+  if (node != NULL) {
+    ngx_c2h5oh_auth_delete(cache, node);
+  }
+
+  // a couple of expired decisions are evicted on each store
+  for(i = 0; i < 2 && !ngx_queue_empty(&cache->sh->queue); i++) {
+    node = ngx_queue_data(ngx_queue_last(&cache->sh->queue), 
+                          ngx_c2h5oh_auth_node_t, queue);
+    if (node->expires > now && node->generation == cache->sh->generation) {
+      break;
+    }
+    ngx_c2h5oh_auth_delete(cache, node);
+  }
+
+  node = ngx_slab_alloc_locked(cache->shpool, 
+                               offsetof(ngx_c2h5oh_auth_node_t, data) + key->len);
+  while(node == NULL && !ngx_queue_empty(&cache->sh->queue)) {
+    ngx_c2h5oh_auth_delete(cache, ngx_queue_data(ngx_queue_last(&cache->sh->queue),
+                                                 ngx_c2h5oh_auth_node_t, queue));
+    node = ngx_slab_alloc_locked(cache->shpool, 
+                                 offsetof(ngx_c2h5oh_auth_node_t, data) + key->len);
+  }
+  if (node != NULL) {
+    ngx_memcpy(node->data, key->data, key->len);
+    node->sn.node.key = hash;
+    node->sn.str.data = node->data;
+    node->sn.str.len  = key->len;
+    node->expires     = now + ttl;
+    node->generation  = cache->sh->generation;
+    node->status      = status;
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+  }
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+//-----------------------------------------------------------------------------
+// drops auth decisions of the session key in all locations, all decisions 
+// if key is NULL
+static void
+ngx_c2h5oh_auth_invalidate(ngx_c2h5oh_auth_cache_t * cache, ngx_str_t * key)
+{
+  ngx_c2h5oh_auth_node_t * node;
+  uint32_t                 hash;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  if (key == NULL) {
+    // stale decisions are evicted lazily
+    cache->sh->generation++;
+  } else {
+    hash = ngx_c2h5oh_auth_hash(key);
+    while((node = ngx_c2h5oh_auth_find_session(cache->sh->rbtree.root, 
+                                               cache->sh->rbtree.sentinel,
+                                               hash, key)) != NULL) 
+    {
+      ngx_c2h5oh_auth_delete(cache, node);
+    }
+  }
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+//-----------------------------------------------------------------------------
+// auth decision key is session key and location name, so decisions of 
+// different locations don't answer each other
+static ngx_int_t
+ngx_c2h5oh_auth_key(ngx_http_request_t * r, ngx_str_t * key)
+{
+  ngx_http_core_loc_conf_t * clcf;
+  u_char                   * p;
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  p = ngx_pnalloc(r->pool, key->len + 1 + clcf->name.len);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(p, key->data, key->len);
+  p[key->len] = '\0';
+  ngx_memcpy(p + key->len + 1, clcf->name.data, clcf->name.len);
+  key->data = p;
+  key->len += 1 + clcf->name.len;
+  return NGX_OK;
+}
+
+//-----------------------------------------------------------------------------
+// decodes json string escapes in place, returns decoded length
+static size_t
+ngx_c2h5oh_json_unescape(u_char * s, size_t len)
+{
+  u_char     * p = s;
+  u_char     * end = s + len;
+  u_char     * d = s;
+  uint32_t     c;
+  ngx_int_t    n;
+
+  while(p < end) {
+    if (*p != '\\' || p + 1 == end) {
+      *d++ = *p++;
+      continue;
+    }
+    p++;
+    switch(*p) {
+      case 'b': *d++ = '\b'; p++; continue;
+      case 'f': *d++ = '\f'; p++; continue;
+      case 'n': *d++ = '\n'; p++; continue;
+      case 'r': *d++ = '\r'; p++; continue;
+      case 't': *d++ = '\t'; p++; continue;
+      case 'u': break;
+      default:  *d++ = *p++;  continue;
+    }
+    if (end - p < 5 || (n = ngx_hextoi(p + 1, 4)) == NGX_ERROR) {
+      *d++ = *p++;
+      continue;
+    }
+    c = n;
+    p += 5;
+    // surrogate pair is one character
+    if (c >= 0xd800 && c <= 0xdbff && end - p >= 6 && p[0] == '\\' && 
+        p[1] == 'u' && (n = ngx_hextoi(p + 2, 4)) >= 0xdc00 && n <= 0xdfff) 
+    {
+      c = 0x10000 + ((c - 0xd800) << 10) + (n - 0xdc00);
+      p += 6;
+    }
+    if (c < 0x80) {
+      *d++ = c;
+    } else if (c < 0x800) {
+      *d++ = 0xc0 | (c >> 6);
+      *d++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      *d++ = 0xe0 | (c >> 12);
+      *d++ = 0x80 | ((c >> 6) & 0x3f);
+      *d++ = 0x80 | (c & 0x3f);
+    } else {
+      *d++ = 0xf0 | (c >> 18);
+      *d++ = 0x80 | ((c >> 12) & 0x3f);
+      *d++ = 0x80 | ((c >> 6) & 0x3f);
+      *d++ = 0x80 | (c & 0x3f);
+    }
+  }
+  return d - s;
+}
+
+//-----------------------------------------------------------------------------
+// cached auth decision is answered without database, body is empty
+static ngx_int_t
+ngx_c2h5oh_auth_cached(ngx_http_request_t * r, ngx_str_t * key)
+{
+  ngx_c2h5oh_main_conf_t * mcf;
+  ngx_int_t                status;
+  ngx_int_t                rc;
+
+  mcf    = ngx_http_get_module_main_conf(r, ngx_c2h5oh_module);
+  status = ngx_c2h5oh_auth_get(mcf->auth_zone->data, key);
+  if (status == NGX_DECLINED || status >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return status;
+  }
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+  r->headers_out.status           = status;
+  r->headers_out.content_length_n = 0;
+  r->header_only                  = 1;
+  return ngx_http_send_header(r);
+}
+
+//-----------------------------------------------------------------------------
+// overloaded pool sheds waiting request with 503, client retries later
+static void
+ngx_c2h5oh_shed(ngx_http_request_t * r)
+{
+  ngx_table_elt_t * h;
+
+  ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "[c2h5oh] connections pool is overloaded, request is shed");
+  h = ngx_list_push(&r->headers_out.headers);
+  if (h != NULL) {
+    h->hash = 1;
+    ngx_str_set(&h->key, "Retry-After");
+    ngx_str_set(&h->value, "1");
+  }
+  ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+}
+
 //-----------------------------------------------------------------------------
 static void
 ngx_c2h5oh_event_handler(ngx_event_t * ev)
@@ -523,12 +1826,17 @@ ngx_c2h5oh_event_handler(ngx_event_t * ev)
     ngx_del_timer(&ctx->timer);
   }
 
+  if (ctx->copy_started) {
+    // streamed response is not limited by c2h5oh_timeout
+    return ngx_c2h5oh_copy_out(r, ctx);
+  }
+
   tp = ngx_timeofday();
   if (tp->sec > ctx->timeout.sec || (tp->sec == ctx->timeout.sec &&
       tp->msec >= ctx->timeout.msec)) 
   {
     if (ctx->conn != NULL) {
-      if (c2h5oh_is_error(ctx->conn)) {
+      if (ctx->cache == NULL && c2h5oh_is_error(ctx->conn)) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "[c2h5oh] error after timeout %s", c2h5oh_result(ctx->conn));
       }
@@ -541,20 +1849,22 @@ ngx_c2h5oh_event_handler(ngx_event_t * ev)
 
   if (ctx->conn == NULL) {
 
-    ctx->conn = c2h5oh_create();
-    if (ctx->conn == NULL) {
+    if (ngx_c2h5oh_acquire(ctx) == NULL) {
+      if (c2h5oh_shed(ngx_current_msec - ctx->wait_start)) {
+        return ngx_c2h5oh_shed(r);
+      }
       ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
       return;
     }
 
-    if (c2h5oh_query(ctx->conn, (const char *)ctx->query.data) != 0) {
+    if (ngx_c2h5oh_query(ctx, ctx->conn) != 0) {
       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                     "[c2h5oh] error create query");
       return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
     }
   }
 
-  if (c2h5oh_poll(ctx->conn) == 0) {
+  if (ngx_c2h5oh_poll(ctx) == 0) {
     ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
   } else {
     ngx_c2h5oh_post_response(r, ctx);
@@ -567,16 +1877,39 @@ static ngx_int_t
 ngx_c2h5oh_handler(ngx_http_request_t *r)
 {
   ngx_int_t               rc;
+  ngx_str_t               auth_key = ngx_null_string;
   ngx_c2h5oh_ctx_t*       ctx;
   ngx_http_cleanup_t*     cln;
   ngx_c2h5oh_loc_conf_t * alcf;
 
   ctx = ngx_http_get_module_ctx(r, ngx_c2h5oh_module);
 
-  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+  alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
+
+  if (!(r->method & alcf->methods & ~NGX_CONF_BITMASK_SET) ||
+      (alcf->batch && r->method != NGX_HTTP_POST) ||
+      ((alcf->copy_in.len || alcf->upload) && 
+       !(r->method & NGX_C2H5OH_BODY_METHODS))) 
+  {
     return NGX_HTTP_NOT_ALLOWED;
   }
 
+  // session auth decision is shared by workers
+  if (ctx == NULL && alcf->auth_key != NULL) {
+    if (ngx_http_complex_value(r, alcf->auth_key, &auth_key) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (auth_key.len) {
+      if (ngx_c2h5oh_auth_key(r, &auth_key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      rc = ngx_c2h5oh_auth_cached(r, &auth_key);
+      if (rc != NGX_DECLINED) {
+        return rc;
+      }
+    }
+  }
+
   if (ctx == NULL) {
     ctx = ngx_palloc(r->pool, sizeof(ngx_c2h5oh_ctx_t));
     if (ctx == NULL) {
@@ -586,17 +1919,54 @@ ngx_c2h5oh_handler(ngx_http_request_t *r)
     }
     bzero(ctx, sizeof(ngx_c2h5oh_ctx_t));
 
-    alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
     ctx->timer.handler = ngx_c2h5oh_event_handler;
     ctx->timer.data    = r;
     ctx->timer.log     = r->connection->log;
+    ctx->priority      = alcf->priority;
+    ctx->auth_key      = auth_key;
+    if (alcf->copy_in.len) {
+      ctx->copy_in       = &alcf->copy_in;
+      ctx->copy_in_state = NGX_C2H5OH_COPY_IN_START;
+    }
+    ctx->body_raw      = alcf->copy_in.len || alcf->upload;
+    // subrequest is GET, method of main request is checked too
+    ctx->hedging       = alcf->hedge && !alcf->batch && !alcf->copy_out &&
+                         !ctx->body_raw &&
+                         (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) &&
+                         (r->main->method & (NGX_HTTP_GET|NGX_HTTP_HEAD));
+    ctx->latency       = ctx->hedging ? alcf->latency : NULL;
     ctx->timeout.msec = (r->start_msec + alcf->timeout) % 1000;
     ctx->timeout.sec  = r->start_sec + (r->start_msec + alcf->timeout) / 1000;
 
     ngx_http_set_ctx(r, ctx, ngx_c2h5oh_module);
+
+    // mapped routes are resolved locally, unknown route is not found
+    if (alcf->map.buckets != NULL) {
+      ngx_str_t  key;
+      ngx_uint_t hash;
+      u_char   * lc;
+      ngx_c2h5oh_route_key(r, alcf, &key);
+      lc = ngx_pnalloc(r->pool, key.len);
+      if (lc == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      hash = ngx_hash_strlow(lc, key.data, key.len);
+      ctx->function = ngx_hash_find(&alcf->map, hash, lc, key.len);
+      if (ctx->function == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+      }
+    }
   }
 
-  if (r->method & NGX_HTTP_POST) {
+  // subrequest (e.g. auth_request of upload) has no body of its own
+  if ((r->method & NGX_C2H5OH_BODY_METHODS) && r == r->main) {
+    if (alcf->upload) {
+      // body file is kept when request is done, see ngx_c2h5oh_upload_cleanup
+      r->request_body_in_file_only       = 1;
+      r->request_body_in_persistent_file = 1;
+      r->request_body_in_clean_file      = 0;
+      r->request_body_file_log_level     = 0;
+    }
     rc = ngx_http_read_client_request_body(r, ngx_c2h5oh_post_handler);
     if (rc == NGX_AGAIN) {
       r->main->count++;
@@ -621,6 +1991,15 @@ ngx_c2h5oh_handler(ngx_http_request_t *r)
     return NGX_HTTP_BAD_REQUEST;
   }
 
+  if (ctx->key.len) {
+    ctx->cache = c2h5oh_cache_get((const char *)ctx->key.data, ctx->key.len,
+                                  ngx_time());
+    if (ctx->cache != NULL) {
+      ngx_c2h5oh_post_response(r, ctx);
+      return NGX_DONE;
+    }
+  }
+
   if (ctx->conn == NULL) {
     cln = ngx_http_cleanup_add(r, 0);
     if (cln == NULL) {
@@ -628,32 +2007,348 @@ ngx_c2h5oh_handler(ngx_http_request_t *r)
                     "[c2h5oh] cannot add cleanup");
       return NGX_ERROR;
     }
-    cln->handler = ngx_c2h5oh_cleanup;
-    cln->data    = ctx;
+    cln->handler = ngx_c2h5oh_cleanup;
+    cln->data    = ctx;
+    // client close finalizes request, cleanup cancels query
+    r->read_event_handler = ngx_http_test_reading;
+
+    if (ngx_c2h5oh_acquire(ctx) == NULL) {
+      ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
+      r->main->count++;
+      return NGX_DONE;
+    }
+
+    if (ngx_c2h5oh_query(ctx, ctx->conn) != 0) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[c2h5oh] error create query");
+      return NGX_ERROR;
+    }
+  }
+
+  if (ngx_c2h5oh_poll(ctx) == 0) {
+    ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
+    r->main->count++;
+    return NGX_DONE;
+  }
+
+  ngx_c2h5oh_post_response(r, ctx);
+  
+  return NGX_DONE;
+}
+
+//-----------------------------------------------------------------------------
+static ngx_int_t
+ngx_c2h5oh_set_etag(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx, 
+                    ngx_str_t * etag, u_char * content, size_t content_length)
+{
+  ngx_table_elt_t * h;
+  uint32_t          hash;
+
+  // etag from result or content length and hash, not modified filter answers
+  // If-None-Match with 304
+  h = ngx_list_push(&r->headers_out.headers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+  h->hash = 1;
+  ngx_str_set(&h->key, "ETag");
+  h->value.data = ngx_pnalloc(r->pool, etag->len + NGX_INT_T_LEN * 2 + 3);
+  if (h->value.data == NULL) {
+    return NGX_ERROR;
+  }
+  if (etag->len) {
+    h->value.len = ngx_sprintf(h->value.data, "\"%V\"", etag) - h->value.data;
+  } else {
+    hash = ngx_murmur_hash2(content, content_length);
+    if (ctx->callback.len) {
+      hash = hash * 31 + ngx_murmur_hash2(ctx->callback.data, ctx->callback.len);
+    }
+    h->value.len = ngx_sprintf(h->value.data, "\"%xz-%xD\"", 
+                               (size_t)content_length, hash) - h->value.data;
+  }
+  r->headers_out.etag = h;
+  return NGX_OK;
+}
+
+//-----------------------------------------------------------------------------
+static void
+ngx_c2h5oh_copy_finalize(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx,
+                         ngx_int_t rc)
+{
+  if (r->method & NGX_C2H5OH_BODY_METHODS) {
+    r->main->count--;
+  }
+  if (ctx->conn != NULL) {
+    c2h5oh_free(ctx->conn); ctx->conn = NULL;
+  }
+  ngx_http_finalize_request(r, rc);
+}
+
+//-----------------------------------------------------------------------------
+// streams COPY TO STDOUT rows, next rows are read only when previous output 
+// is sent, so slow client holds database back instead of filling memory
+static void
+ngx_c2h5oh_copy_out(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
+{
+  ngx_int_t     rc;
+  ngx_uint_t    i;
+  ngx_uint_t    wait = 0;
+  ngx_buf_t   * b;
+  ngx_chain_t * cl;
+  ngx_chain_t * out = NULL;
+  ngx_chain_t **ll = &out;
+  const char  * data;
+  size_t        len;
+  int           n;
+
+  if (!ctx->copy_started) {
+    ctx->copy_started = 1;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type = ctx->copy == NGX_C2H5OH_COPY_CSV ? 
+      k_ngx_c2h5oh_csv_type : k_ngx_c2h5oh_text_type;
+    r->headers_out.content_type_len  = r->headers_out.content_type.len;
+    r->headers_out.content_length_n  = -1;
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+      return ngx_c2h5oh_copy_finalize(r, ctx, rc);
+    }
+  }
+
+  for(i = 0; ctx->busy == NULL && !ctx->copy_done && !wait && 
+      i < NGX_C2H5OH_COPY_BUFS; i++) 
+  {
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+      return ngx_c2h5oh_copy_finalize(r, ctx, NGX_ERROR);
+    }
+    b = cl->buf;
+    if (b->start == NULL) {
+      b->start = ngx_palloc(r->pool, NGX_C2H5OH_COPY_BUF_SIZE);
+      if (b->start == NULL) {
+        return ngx_c2h5oh_copy_finalize(r, ctx, NGX_ERROR);
+      }
+      b->end       = b->start + NGX_C2H5OH_COPY_BUF_SIZE;
+      b->temporary = 1;
+      b->tag       = (ngx_buf_tag_t)&ngx_c2h5oh_module;
+    }
+    b->pos = b->last = b->start;
+
+    while(b->last < b->end) {
+      if (ctx->copy_rest.len == 0) {
+        n = c2h5oh_copy_data(ctx->conn, &data);
+        if (n < 0) {
+          ctx->copy_done = 1;
+          break;
+        }
+        if (n == 0) {
+          wait = 1;
+          break;
+        }
+        ctx->copy_rest.data = (u_char *)data;
+        ctx->copy_rest.len  = n;
+      }
+      len = ngx_min(ctx->copy_rest.len, (size_t)(b->end - b->last));
+      b->last = ngx_cpymem(b->last, ctx->copy_rest.data, len);
+      ctx->copy_rest.data += len;
+      ctx->copy_rest.len  -= len;
+    }
+
+    if (b->last == b->pos) {
+      cl->next  = ctx->free;
+      ctx->free = cl;
+      break;
+    }
+    b->flush = 1;
+    *ll = cl;
+    ll  = &cl->next;
+  }
+
+  if (out != NULL || ctx->busy != NULL) {
+    rc = ngx_http_output_filter(r, out);
+    if (rc == NGX_ERROR) {
+      return ngx_c2h5oh_copy_finalize(r, ctx, NGX_ERROR);
+    }
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out, 
+                            (ngx_buf_tag_t)&ngx_c2h5oh_module);
+  }
+
+  if (!ctx->copy_done) {
+    ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
+    return;
+  }
+
+  // COPY command result follows copy data
+  if (c2h5oh_poll(ctx->conn) == 0) {
+    ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
+    return;
+  }
+  if (c2h5oh_is_error(ctx->conn)) {
+    // headers are sent already, truncated response is closed
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] copy error %s", c2h5oh_result(ctx->conn));
+    return ngx_c2h5oh_copy_finalize(r, ctx, NGX_ERROR);
+  }
+
+  b  = ngx_calloc_buf(r->pool);
+  cl = ngx_alloc_chain_link(r->pool);
+  if (b == NULL || cl == NULL) {
+    return ngx_c2h5oh_copy_finalize(r, ctx, NGX_ERROR);
+  }
+  b->last_buf      = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  cl->buf  = b;
+  cl->next = NULL;
+  ngx_c2h5oh_copy_finalize(r, ctx, ngx_http_output_filter(r, cl));
+}
+
+//-----------------------------------------------------------------------------
+// serves route envelope "file" from c2h5oh_file_root with sendfile, ranges
+// and conditional requests are handled by nginx filters
+static void
+ngx_c2h5oh_send_file(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx, 
+                     ngx_str_t * file)
+{
+  ngx_int_t                  rc;
+  ngx_buf_t                * b;
+  ngx_chain_t                out;
+  ngx_str_t                  path;
+  u_char                   * p;
+  u_char                   * s;
+  u_char                   * end;
+  ngx_open_file_info_t       of;
+  ngx_http_core_loc_conf_t * clcf;
+  ngx_c2h5oh_loc_conf_t    * alcf;
+
+  if (ctx->conn != NULL) {
+    c2h5oh_free(ctx->conn); ctx->conn = NULL;
+  }
+
+  alcf = ngx_http_get_module_loc_conf(r, ngx_c2h5oh_module);
+  if (alcf->file_root.len == 0) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] file response requires c2h5oh_file_root");
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+
+  // file is relative to root, parent directory segments are not allowed
+  end = file->data + file->len;
+  while(file->len && *file->data == '/') {
+    file->data++;
+    file->len--;
+  }
+  for(p = file->data, s = p; file->len && s < end; p = ++s) {
+    while(s < end && *s != '/' && *s != '\\' && *s != '\0') {
+      s++;
+    }
+    if ((s < end && *s != '/') || (s - p == 2 && p[0] == '.' && p[1] == '.')) {
+      file->len = 0;
+    }
+  }
+  if (file->len == 0) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] wrong file: [%*s]", (size_t)(end - file->data),
+                  file->data);
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+
+  path.len  = alcf->file_root.len + 1 + file->len;
+  path.data = ngx_pnalloc(r->pool, path.len + 1);
+  if (path.data == NULL) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+  p = ngx_cpymem(path.data, alcf->file_root.data, alcf->file_root.len);
+  *p++ = '/';
+  p = ngx_cpymem(p, file->data, file->len);
+  *p = '\0';
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+  of.read_ahead = clcf->read_ahead;
+  of.directio   = clcf->directio;
+  of.valid      = clcf->open_file_cache_valid;
+  of.min_uses   = clcf->open_file_cache_min_uses;
+  of.errors     = clcf->open_file_cache_errors;
+  of.events     = clcf->open_file_cache_events;
+
+  if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+  if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) 
+      != NGX_OK) 
+  {
+    switch(of.err) {
+      case NGX_ENOENT:
+      case NGX_ENOTDIR:
+      case NGX_ENAMETOOLONG:
+        rc = NGX_HTTP_NOT_FOUND;
+        break;
+      case NGX_EACCES:
+        rc = NGX_HTTP_FORBIDDEN;
+        break;
+      default:
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (rc != NGX_HTTP_NOT_FOUND) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, of.err,
+                    "[c2h5oh] %s \"%V\" failed", of.failed, &path);
+    }
+    return ngx_http_finalize_request(r, rc);
+  }
+  if (!of.is_file) {
+    return ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+  }
 
-    ctx->conn = c2h5oh_create();
-    if (ctx->conn == NULL) {
-      ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
-      r->main->count++;
-      return NGX_DONE;
+  if (r->headers_out.status == 0) {
+    r->headers_out.status = NGX_HTTP_OK;
+  }
+  r->headers_out.content_length_n   = of.size;
+  r->headers_out.last_modified_time = of.mtime;
+  if (ngx_http_set_etag(r) != NGX_OK) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+  if (r->headers_out.content_type.len == 0) {
+    // type by file extension
+    r->exten.len = 0;
+    for(p = end; p > file->data && *(p - 1) != '/'; p--) {
+      if (*(p - 1) == '.') {
+        r->exten.data = p;
+        r->exten.len  = end - p;
+        break;
+      }
     }
-
-    if (c2h5oh_query(ctx->conn, (const char *)ctx->query.data) != 0) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[c2h5oh] error create query");
-      return NGX_ERROR;
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+      return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
     }
   }
+  r->allow_ranges = 1;
 
-  if (c2h5oh_poll(ctx->conn) == 0) {
-    ngx_add_timer(&ctx->timer, (ngx_msec_t)1);
-    r->main->count++;
-    return NGX_DONE;
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+  b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  if (b->file == NULL) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
   }
 
-  ngx_c2h5oh_post_response(r, ctx);
-  
-  return NGX_DONE;
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return ngx_http_finalize_request(r, rc);
+  }
+
+  b->file_pos      = 0;
+  b->file_last     = of.size;
+  b->in_file       = b->file_last ? 1 : 0;
+  b->last_buf      = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  b->file->fd       = of.fd;
+  b->file->name     = path;
+  b->file->log      = r->connection->log;
+  b->file->directio = of.is_directio;
+
+  out.buf  = b;
+  out.next = NULL;
+  ngx_http_finalize_request(r, ngx_http_output_filter(r, &out));
 }
 
 //-----------------------------------------------------------------------------
@@ -664,12 +2359,25 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
   ngx_chain_t   out;
   ngx_int_t     rc;
 
-  if (r->method & NGX_HTTP_POST) {
+  if (ctx->copy && ctx->cache == NULL && c2h5oh_is_copy(ctx->conn)) {
+    return ngx_c2h5oh_copy_out(r, ctx);
+  }
+
+  if (r->method & NGX_C2H5OH_BODY_METHODS) {
     r->main->count--;
   }
 
-  const char * result_src = c2h5oh_result(ctx->conn);
-  int result_len = c2h5oh_result_len(ctx->conn);
+  const char * result_src;
+  int result_len;
+  size_t cached_len;
+
+  if (ctx->cache != NULL) {
+    result_src = c2h5oh_cache_result(ctx->cache, &cached_len);
+    result_len = cached_len;
+  } else {
+    result_src = c2h5oh_result(ctx->conn);
+    result_len = c2h5oh_result_len(ctx->conn);
+  }
 
   if (result_len <= 0 || result_src == NULL) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -678,18 +2386,29 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
     return ngx_http_finalize_request(r, NGX_HTTP_NO_CONTENT);
   }
 
-  if (c2h5oh_is_error(ctx->conn)) {
+  if (ctx->cache == NULL && c2h5oh_is_error(ctx->conn)) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "[c2h5oh] query error %s", result_src);
     c2h5oh_free(ctx->conn); ctx->conn = NULL;
     if (result_len > 6 && ngx_memcmp(result_src, "42883_", sizeof("42883_") - 1) == 0) {
       return ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+    } else if (result_len > 6 && ctx->statement_timeout &&
+               ngx_memcmp(result_src, "57014_", sizeof("57014_") - 1) == 0) 
+    {
+      // canceled by statement_timeout at request deadline
+      return ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+    } else if (result_len > 6 && ctx->copy_in && ctx->copy_in_state &&
+               ngx_memcmp(result_src, "22", sizeof("22") - 1) == 0) 
+    {
+      // malformed copy data is client error
+      return ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
     } else {
       return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
     }
   }
 
-  b = ngx_create_temp_buf(r->pool, result_len + ctx->callback.len + sizeof("();"));
+  b = ngx_create_temp_buf(r->pool, result_len + ctx->callback.len + sizeof("();") +
+                                   sizeof("{\"content\":}"));
   if (b == NULL) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "[c2h5oh] allocation error");
@@ -697,39 +2416,30 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
   }
 
   b->pos = b->start + ctx->callback.len + 1; 
-  memcpy(b->pos, result_src, result_len);
-  b->last = b->pos + result_len;
-
-  jsmn_init(&ngx_c2h5oh_jsmn_parser);
+  if (ctx->batch || ctx->rows) {
+    // batch results or rows array is the content, batch items have own status
+    b->last = ngx_cpymem(b->pos, "{\"content\":", sizeof("{\"content\":") - 1);
+    b->last = ngx_cpymem(b->last, result_src, result_len);
+    *b->last++ = '}';
+  } else {
+    b->last = ngx_cpymem(b->pos, result_src, result_len);
+  }
 
   int i, j;
-  int js = JSMN_ERROR_NOMEM;
+  int js;
   u_char * content = NULL;
-  int content_length = 0;
-
-  while(js == JSMN_ERROR_NOMEM) {
-    js = jsmn_parse(&ngx_c2h5oh_jsmn_parser, (char *)b->pos, result_len, 
-                    ngx_c2h5oh_js_tokens, ngx_c2h5oh_js_tokens_count);
-    if (js < -1) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[c2h5oh] json parse error: invalid json string");
-      return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    } else if (js == JSMN_ERROR_NOMEM) {
-      ngx_c2h5oh_js_tokens_count *= 3; ngx_c2h5oh_js_tokens_count /= 2;
-      void * p = realloc(ngx_c2h5oh_js_tokens, 
-                         sizeof(jsmntok_t) * ngx_c2h5oh_js_tokens_count);
-      if (p == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "[c2h5oh] error allocating ngx_c2h5oh_js_tokens");
-        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-      } else {
-        ngx_c2h5oh_js_tokens = p;
-      }
-    } else if (js == 0) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[c2h5oh] json parse error: empty json");
-      return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    }
+  size_t content_length = 0;
+  ngx_int_t cache_ttl = 0;
+  ngx_str_t etag = ngx_null_string;
+  ngx_str_t invalidate = ngx_null_string;
+  ngx_str_t file = ngx_null_string;
+  ngx_uint_t invalidate_all = 0;
+  ngx_uint_t status;
+  ngx_c2h5oh_main_conf_t * mcf;
+
+  js = ngx_c2h5oh_json_parse(r, b->pos, b->last - b->pos);
+  if (js <= 0) {
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
   }
 
   jsmntok_t * t = ngx_c2h5oh_js_tokens;
@@ -776,6 +2486,13 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
                 break;
               }
             }
+            // content is already compressed, gzip filter skips it
+            if (set_header->key.len == sizeof("Content-Encoding") - 1 &&
+                ngx_strncasecmp(set_header->key.data, (u_char *)"Content-Encoding",
+                                set_header->key.len) == 0) 
+            {
+              r->headers_out.content_encoding = set_header;
+            }
           }
         }
       } else {
@@ -801,6 +2518,44 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
                       "[c2h5oh] wrong status: [%.*s]", t->end - t->start, b->pos + t->start);
         return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
       }
+    } else if (NGX_C2H5OH_JSON_KEY_IS(b->pos, t, "etag")) {
+      t++;
+      if (t->type != JSMN_STRING) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[c2h5oh] json error: etag has to be a string");
+        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      }
+      etag.data = b->pos + t->start;
+      etag.len  = t->end - t->start;
+    } else if (NGX_C2H5OH_JSON_KEY_IS(b->pos, t, "cache")) {
+      t++;
+      cache_ttl = ngx_atoi(b->pos + t->start, t->end - t->start);
+      if (t->type != JSMN_PRIMITIVE || cache_ttl == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[c2h5oh] wrong cache: [%.*s]", t->end - t->start, b->pos + t->start);
+        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      }
+    } else if (NGX_C2H5OH_JSON_KEY_IS(b->pos, t, "file")) {
+      t++;
+      if (t->type != JSMN_STRING) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[c2h5oh] json error: file has to be a string");
+        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      }
+      file.data = b->pos + t->start;
+      file.len  = t->end - t->start;
+    } else if (NGX_C2H5OH_JSON_KEY_IS(b->pos, t, "invalidate")) {
+      t++;
+      // session key of cached auth decision, true drops all decisions
+      if (t->type == JSMN_STRING) {
+        invalidate.data = b->pos + t->start;
+        invalidate.len  = ngx_c2h5oh_json_unescape(invalidate.data, 
+                                                   t->end - t->start);
+      } else if (t->type == JSMN_PRIMITIVE && 
+                 NGX_C2H5OH_JSON_KEY_IS(b->pos, t, "true")) 
+      {
+        invalidate_all = 1;
+      }
     } else {
       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
         "[c2h5oh] unexpected token in json: [%*.s]", t->end - t->start, b->pos + t->start);
@@ -808,6 +2563,29 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
     }
   }
 
+  // cached response replay doesn't touch auth decisions again
+  mcf = ngx_http_get_module_main_conf(r, ngx_c2h5oh_module);
+  if (mcf->auth_zone != NULL && ctx->cache == NULL) {
+    if (invalidate_all) {
+      ngx_c2h5oh_auth_invalidate(mcf->auth_zone->data, NULL);
+    } else if (invalidate.len) {
+      ngx_c2h5oh_auth_invalidate(mcf->auth_zone->data, &invalidate);
+    }
+    // auth decision is cached for "cache" seconds, allowed or denied only
+    status = r->headers_out.status ? r->headers_out.status : NGX_HTTP_OK;
+    if (ctx->auth_key.len && cache_ttl > 0 && 
+        ((status >= NGX_HTTP_OK && status < NGX_HTTP_SPECIAL_RESPONSE) ||
+         status == NGX_HTTP_UNAUTHORIZED || status == NGX_HTTP_FORBIDDEN)) 
+    {
+      ngx_c2h5oh_auth_put(mcf->auth_zone->data, &ctx->auth_key, status, 
+                          cache_ttl);
+    }
+  }
+
+  if (file.len) {
+    return ngx_c2h5oh_send_file(r, ctx, &file);
+  }
+
   if (content_length == 0) {
     if (r->headers_out.status == 404) {
       return ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
@@ -820,10 +2598,26 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
     }
   }
 
+  // result is cached for "cache" seconds, successful GET responses only,
+  // responses invalidating auth decisions are not replayed
+  if (ctx->cache == NULL && cache_ttl > 0 && ctx->key.len &&
+      invalidate.len == 0 && !invalidate_all &&
+      (r->headers_out.status == 0 || r->headers_out.status == 200)) 
+  {
+    ctx->cache = c2h5oh_cache_put((const char *)ctx->key.data, ctx->key.len,
+                                  result_src, result_len, ngx_time() + cache_ttl);
+  }
+
   b->last_buf = 1;
   b->pos = content;
   b->last  = content + content_length;
 
+  if (ngx_c2h5oh_set_etag(r, ctx, &etag, content, content_length) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "[c2h5oh] allocation error");
+    return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+
   //if (ctx->callback.len) {
   //  b->pos -= ctx->callback.len + 1;
   //  ngx_memcpy(b->pos, ctx->callback.data, ctx->callback.len);
@@ -842,30 +2636,39 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
       b->pos[2] == 'x' &&   //
       (content_length - 3) / 2 * 2 == content_length - 3) // check len div 2
   {
-    // decode binary data
-    const unsigned char * src = b->pos + 3; // skip header
-    unsigned char * dst = b->pos;
-    while(src != b->last) {
-      if (*src < '0' || (*src > '9' && (*src < 'a' || *src > 'f'))) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-          "[c2h5oh] unexpected byte in binary data at pos %d: %d", src - b->pos, *src);
-        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-      }
-      *dst = (((*src > '9') ? (*src - 'a' + 10) : *src - '0') << 4);
-      src++;
+    if (r->header_only) { // HEAD, body is not sent, length only
+      content_length = (content_length - 3) / 2;
+    } else {
+      // decode binary data
+      const unsigned char * src = b->pos + 3; // skip header
+      unsigned char * dst = b->pos;
+      while(src != b->last) {
+        if (*src < '0' || (*src > '9' && (*src < 'a' || *src > 'f'))) {
+          ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "[c2h5oh] unexpected byte in binary data at pos %d: %d", src - b->pos, *src);
+          return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        *dst = (((*src > '9') ? (*src - 'a' + 10) : *src - '0') << 4);
+        src++;
 
-      if (*src < '0' || (*src > '9' && (*src < 'a' || *src > 'f'))) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-          "[c2h5oh] unexpected byte in binary data at pos %d: %d", src - b->pos, *src);
-        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        if (*src < '0' || (*src > '9' && (*src < 'a' || *src > 'f'))) {
+          ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "[c2h5oh] unexpected byte in binary data at pos %d: %d", src - b->pos, *src);
+          return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        *dst |= (*src > '9') ? (*src - 'a' + 10) : (*src - '0');
+        src++;
+
+        dst++;
       }
-      *dst |= (*src > '9') ? (*src - 'a' + 10) : (*src - '0');
-      src++;
+      b->last = dst;
+      content_length = b->last - b->pos;
+    }
 
-      dst++;
+  } else if (r->header_only) { // HEAD, callback is not written
+    if (ctx->callback.len) {
+      content_length += ctx->callback.len + sizeof("();") - 1;
     }
-    b->last = dst;
-    content_length = b->last - b->pos;
 
   } else {
     if (ctx->callback.len) {
@@ -879,7 +2682,36 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
     }
   }
 
-  c2h5oh_free(ctx->conn); ctx->conn = NULL;
+#if (NGX_HTTP_GZIP)
+  // cached content is compressed once and served as is to gzip clients
+  if (ctx->cache != NULL && !r->header_only && 
+      r->headers_out.content_encoding == NULL && ngx_http_gzip_ok(r) == NGX_OK) 
+  {
+    size_t gzip_len;
+    const char * gzip = c2h5oh_cache_gzip(ctx->cache, (const char *)b->pos,
+                                          content_length, &gzip_len);
+    if (gzip != NULL) {
+      ngx_table_elt_t * h = ngx_list_push(&r->headers_out.headers);
+      b->pos = ngx_pnalloc(r->pool, gzip_len);
+      if (h == NULL || b->pos == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[c2h5oh] allocation error");
+        return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      }
+      b->last = ngx_cpymem(b->pos, gzip, gzip_len);
+      content_length = gzip_len;
+      h->hash = 1;
+      ngx_str_set(&h->key, "Content-Encoding");
+      ngx_str_set(&h->value, "gzip");
+      r->headers_out.content_encoding = h;
+      ngx_http_weak_etag(r);
+    }
+  }
+#endif
+
+  if (ctx->conn != NULL) {
+    c2h5oh_free(ctx->conn); ctx->conn = NULL;
+  }
 
   if (r->headers_out.content_type.len == 0) {
     r->headers_out.content_type.len = sizeof(ngx_c2h5oh_content_type) - 1;
@@ -909,8 +2741,9 @@ ngx_c2h5oh_post_response(ngx_http_request_t * r, ngx_c2h5oh_ctx_t * ctx)
 static char *
 ngx_c2h5oh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-  ngx_str_t             *value;
-  ngx_c2h5oh_loc_conf_t *alcf = conf;
+  ngx_str_t              *value;
+  ngx_c2h5oh_loc_conf_t  *alcf = conf;
+  ngx_c2h5oh_main_conf_t *mcf;
 
   if (alcf->enabled) {
     return "is duplicate";
@@ -937,13 +2770,19 @@ ngx_c2h5oh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
   alcf->pool_size = pool_size;
 
-  if (c2h5oh_module_init((const char *)alcf->db_path.data, 
-                                alcf->db_path.len, alcf->pool_size) != 0) 
+  // all locations share one process wide pool, see ngx_c2h5oh_init_main_conf
+  mcf = ngx_http_conf_get_module_main_conf(cf, ngx_c2h5oh_module);
+  if (mcf->pool_size == 0) {
+    mcf->db_path   = alcf->db_path;
+    mcf->pool_size = alcf->pool_size;
+  } else if (mcf->pool_size != alcf->pool_size ||
+             mcf->db_path.len != alcf->db_path.len ||
+             ngx_strncmp(mcf->db_path.data, alcf->db_path.data, 
+                         mcf->db_path.len) != 0) 
   {
-    ngx_log_error(NGX_LOG_ERR, cf->log, 0, "[c2h5oh] error init c2h5oh");
-    return NGX_CONF_ERROR;
+    return "differs from previous c2h5oh_pass, all locations share one pool";
   }
-    
+
   ngx_http_core_loc_conf_t  *clcf;
 
   clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
@@ -952,3 +2791,280 @@ ngx_c2h5oh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
   return NGX_CONF_OK;
 }
 
+//-----------------------------------------------------------------------------
+// c2h5oh_pool [policy=lifo|fifo] [max_idle_time=<time>] [min=<size>] 
+//             [target_wait=<time>] [reset=on|off] [shed=<time>] 
+//             [shed_interval=<time>]
+static char *
+ngx_c2h5oh_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_str_t              *value;
+  ngx_str_t               v;
+  ngx_uint_t              i;
+  ngx_c2h5oh_main_conf_t *mcf = conf;
+
+  if (mcf->pool_policy != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  mcf->pool_policy = C2H5OH_POOL_LIFO;
+
+  value = cf->args->elts;
+
+  for(i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strcmp(value[i].data, "policy=lifo") == 0) {
+      mcf->pool_policy = C2H5OH_POOL_LIFO;
+    } else if (ngx_strcmp(value[i].data, "policy=fifo") == 0) {
+      mcf->pool_policy = C2H5OH_POOL_FIFO;
+    } else if (ngx_strncmp(value[i].data, "max_idle_time=", 
+                           sizeof("max_idle_time=") - 1) == 0) 
+    {
+      v.data = value[i].data + sizeof("max_idle_time=") - 1;
+      v.len  = value[i].len - (sizeof("max_idle_time=") - 1);
+      mcf->max_idle_time = ngx_parse_time(&v, 1);
+      if (mcf->max_idle_time == NGX_ERROR || mcf->max_idle_time == 0) {
+        return "max_idle_time is invalid";
+      }
+    } else if (ngx_strcmp(value[i].data, "reset=on") == 0) {
+      mcf->reset = 1;
+    } else if (ngx_strcmp(value[i].data, "reset=off") == 0) {
+      mcf->reset = 0;
+    } else if (ngx_strncmp(value[i].data, "min=", sizeof("min=") - 1) == 0) {
+      mcf->min_size = ngx_atoi(value[i].data + sizeof("min=") - 1, 
+                               value[i].len - (sizeof("min=") - 1));
+      if (mcf->min_size <= 0) {
+        return "min is invalid";
+      }
+    } else if (ngx_strncmp(value[i].data, "target_wait=", 
+                           sizeof("target_wait=") - 1) == 0) 
+    {
+      v.data = value[i].data + sizeof("target_wait=") - 1;
+      v.len  = value[i].len - (sizeof("target_wait=") - 1);
+      mcf->target_wait = ngx_parse_time(&v, 0);
+      if (mcf->target_wait == NGX_ERROR) {
+        return "target_wait is invalid";
+      }
+    } else if (ngx_strncmp(value[i].data, "shed=", sizeof("shed=") - 1) == 0) {
+      v.data = value[i].data + sizeof("shed=") - 1;
+      v.len  = value[i].len - (sizeof("shed=") - 1);
+      mcf->shed = ngx_parse_time(&v, 0);
+      if (mcf->shed == NGX_ERROR) {
+        return "shed is invalid";
+      }
+    } else if (ngx_strncmp(value[i].data, "shed_interval=", 
+                           sizeof("shed_interval=") - 1) == 0) 
+    {
+      v.data = value[i].data + sizeof("shed_interval=") - 1;
+      v.len  = value[i].len - (sizeof("shed_interval=") - 1);
+      mcf->shed_interval = ngx_parse_time(&v, 0);
+      if (mcf->shed_interval == NGX_ERROR) {
+        return "shed_interval is invalid";
+      }
+    } else {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                         "invalid parameter \"%V\"", &value[i]);
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
+
+//-----------------------------------------------------------------------------
+static char *
+ngx_c2h5oh_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_str_t             *value;
+  ngx_str_t             *function;
+  ngx_hash_key_t        *k;
+  ngx_uint_t             i;
+  ngx_c2h5oh_loc_conf_t *alcf = conf;
+
+  value = cf->args->elts;
+
+  // route is uri without root and trailing slash
+  if (value[1].len == 0 || value[1].data[0] != '/') {
+    return "route has to start with /";
+  }
+  if (value[1].len > 1 && value[1].data[value[1].len - 1] == '/') {
+    value[1].len--;
+  }
+
+  // function name is a part of query text
+  for(i = 0; i < value[2].len; i++) {
+    u_char c = value[2].data[i];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || 
+          (c >= 'A' && c <= 'Z') || c == '_' || c == '.')) 
+    {
+      return "function name is invalid";
+    }
+  }
+  if (value[2].len == 0) {
+    return "function name is invalid";
+  }
+
+  if (alcf->map_keys == NULL) {
+    alcf->map_keys = ngx_array_create(cf->pool, 16, sizeof(ngx_hash_key_t));
+    if (alcf->map_keys == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  k = alcf->map_keys->elts;
+  for(i = 0; i < alcf->map_keys->nelts; i++) {
+    if (k[i].key.len == value[1].len && 
+        ngx_strncasecmp(k[i].key.data, value[1].data, value[1].len) == 0) 
+    {
+      return "route is duplicate";
+    }
+  }
+
+  function = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+  k = ngx_array_push(alcf->map_keys);
+  if (function == NULL || k == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  *function = value[2];
+
+  k->key      = value[1];
+  k->key_hash = ngx_hash_key_lc(value[1].data, value[1].len);
+  k->value    = function;
+
+  return NGX_CONF_OK;
+}
+
+//-----------------------------------------------------------------------------
+static char *
+ngx_c2h5oh_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_str_t                        *value;
+  ngx_c2h5oh_setting_t             *s;
+  ngx_http_compile_complex_value_t  ccv;
+  ngx_c2h5oh_loc_conf_t            *alcf = conf;
+
+  value = cf->args->elts;
+
+  if (alcf->settings == NULL) {
+    alcf->settings = ngx_array_create(cf->pool, 4, sizeof(ngx_c2h5oh_setting_t));
+    if (alcf->settings == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  if (alcf->settings->nelts == NGX_C2H5OH_MAX_SETTINGS) {
+    return "too many settings";
+  }
+
+  s = ngx_array_push(alcf->settings);
+  if (s == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  s->name = value[1];
+
+  ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+  ccv.cf            = cf;
+  ccv.value         = &value[2];
+  ccv.complex_value = &s->value;
+  if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+//-----------------------------------------------------------------------------
+// c2h5oh_priority_class <class> [reserve=<connections>] [weight=<share>]
+static char *
+ngx_c2h5oh_priority_class(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_str_t  *value;
+  ngx_int_t   cls;
+  ngx_int_t   reserved = 0;
+  ngx_int_t   weight = 1;
+  ngx_uint_t  i;
+
+  value = cf->args->elts;
+
+  cls = ngx_atoi(value[1].data, value[1].len);
+  if (cls == NGX_ERROR || cls >= C2H5OH_MAX_CLASSES) {
+    return "class is invalid";
+  }
+  for(i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "reserve=", sizeof("reserve=") - 1) == 0) {
+      reserved = ngx_atoi(value[i].data + sizeof("reserve=") - 1, 
+                          value[i].len - (sizeof("reserve=") - 1));
+      if (reserved == NGX_ERROR) {
+        return "reserve is invalid";
+      }
+    } else if (ngx_strncmp(value[i].data, "weight=", 
+                           sizeof("weight=") - 1) == 0) 
+    {
+      weight = ngx_atoi(value[i].data + sizeof("weight=") - 1, 
+                        value[i].len - (sizeof("weight=") - 1));
+      if (weight <= 0) {
+        return "weight is invalid";
+      }
+    } else {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                         "invalid parameter \"%V\"", &value[i]);
+      return NGX_CONF_ERROR;
+    }
+  }
+  c2h5oh_module_set_class(cls, reserved, weight);
+
+  return NGX_CONF_OK;
+}
+
+//-----------------------------------------------------------------------------
+// c2h5oh_hedge <replica connection string> <pool_size> [percentile=<n>]
+static char *
+ngx_c2h5oh_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_str_t             *value;
+  ngx_int_t              pool_size;
+  ngx_int_t              percentile = 95;
+  ngx_c2h5oh_loc_conf_t *alcf = conf;
+
+  if (alcf->hedge != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  alcf->hedge = 1;
+
+  value = cf->args->elts;
+
+  if (value[1].len == 0) {
+    return "replica connection string is not specified";
+  }
+  pool_size = ngx_atoi(value[2].data, value[2].len);
+  if (pool_size <= 0) {
+    return "pool size is invalid";
+  }
+  if (cf->args->nelts > 3) {
+    if (ngx_strncmp(value[3].data, "percentile=", 
+                    sizeof("percentile=") - 1) != 0) 
+    {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                         "invalid parameter \"%V\"", &value[3]);
+      return NGX_CONF_ERROR;
+    }
+    percentile = ngx_atoi(value[3].data + sizeof("percentile=") - 1, 
+                          value[3].len - (sizeof("percentile=") - 1));
+    if (percentile <= 0 || percentile >= 100) {
+      return "percentile is invalid";
+    }
+  }
+
+  // hedge delay is latency percentile of the location queries
+  alcf->latency = ngx_pcalloc(cf->pool, sizeof(c2h5oh_latency_t));
+  if (alcf->latency == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  alcf->latency->percentile = percentile;
+
+  if (c2h5oh_module_init_hedge((const char *)value[1].data, value[1].len, 
+                               pool_size) != 0) 
+  {
+    ngx_log_error(NGX_LOG_ERR, cf->log, 0, "[c2h5oh] error init hedge pool");
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
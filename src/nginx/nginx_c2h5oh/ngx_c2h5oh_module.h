@@ -5,18 +5,115 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <nginx.h>
+#include <sys/mman.h>
 
 #include "c2h5oh.h"
 
+//-----------------------------------------------------------------------------
+#define NGX_C2H5OH_MAX_PARAMS 5 // uri, cookies, args, body or file, method
+#define NGX_C2H5OH_MAX_SETTINGS 8 // c2h5oh_set per location
+#define NGX_C2H5OH_MAX_BATCH 32   // c2h5oh_batch items
+#define NGX_C2H5OH_COPY_CSV  1    // c2h5oh_copy_out formats
+#define NGX_C2H5OH_COPY_TEXT 2
+#define NGX_C2H5OH_COPY_BUF_SIZE 16384 // COPY TO STDOUT output buffer size
+#define NGX_C2H5OH_COPY_BUFS 4    // COPY TO STDOUT buffers in flight
+#define NGX_C2H5OH_COPY_IN_START 1 // COPY FROM STDIN is sent
+#define NGX_C2H5OH_COPY_IN_SEND  2 // request body is sent as copy data
+#define NGX_C2H5OH_COPY_IN_END   3 // copy end is sent, waiting for result
+
 //-----------------------------------------------------------------------------
 typedef struct {
   ngx_event_t timer; 
   c2h5oh_t * conn;
-  ngx_str_t  query;
+  c2h5oh_t * hedge;            // replica connection of hedged query
+  ngx_uint_t hedging;          // slow query can be hedged
+  ngx_msec_t query_start;      // query start time
+  ngx_msec_t hedge_start;      // hedge query start time
+  c2h5oh_latency_t * latency;  // location queries latency, NULL - no hedge
+  ngx_str_t  query;            // query text followed by parameters data
   ngx_time_t timeout;
   ngx_str_t  callback;
+  ngx_str_t  body;             // request body
+  ngx_uint_t body_json;        // body is passed as json query parameter
+  ngx_uint_t body_raw;         // body is copy data or uploaded file
+  ngx_str_t  upload;           // uploaded file metadata json, null terminated
+  ngx_str_t  auth_key;         // auth decision cache key, session key, '\0'
+                               // and location name, empty if not cached
+  ngx_str_t *function;         // mapped route function, NULL if not mapped
+  ngx_uint_t prepared;         // query is executed as prepared statement
+  ngx_str_t  key;              // cache key, empty if not cacheable
+  c2h5oh_cache_entry_t * cache; // cached result
+  ngx_uint_t waiting;          // request waits for free connection
+  ngx_int_t  priority;         // connections pool priority class
+  ngx_msec_t wait_start;       // connection wait start time
+  ngx_uint_t   nparams;
+  const char * param_values[NGX_C2H5OH_MAX_PARAMS];
+  int          param_lengths[NGX_C2H5OH_MAX_PARAMS];
+  int          param_formats[NGX_C2H5OH_MAX_PARAMS];
+  ngx_str_t    preamble;       // set_config statement, empty if no settings
+  ngx_uint_t   preamble_nparams;
+  const char * preamble_values[NGX_C2H5OH_MAX_SETTINGS * 2 + 1];
+  ngx_uint_t   statement_timeout;  // remaining time is sent as statement_timeout
+  u_char       statement_timeout_value[NGX_INT_T_LEN + 1];
+  ngx_uint_t   batch;          // batch items count, 0 - not a batch
+  ngx_uint_t   rows;           // result is json array of function rows
+  const char **batch_values;   // batch items uri, cookies, args
+  ngx_uint_t   copy;           // COPY TO STDOUT format, 0 - not a copy
+  ngx_uint_t   copy_started;   // copy headers are sent, rows are streamed
+  ngx_uint_t   copy_done;      // all copy rows are read
+  ngx_str_t    copy_rest;      // row part which didn't fit output buffer
+  ngx_chain_t *free;           // free copy output buffers
+  ngx_chain_t *busy;           // copy output buffers not sent yet
+  ngx_str_t   *copy_in;        // COPY FROM STDIN statement, body is data
+  ngx_uint_t   copy_in_state;  // body copy stage, 0 - route function query
+  size_t       copy_in_sent;   // body bytes sent as copy data
 } ngx_c2h5oh_ctx_t;
 
+typedef struct {
+  ngx_str_node_t sn;           // session and location key, str points to 
+                               // data, node key is hash of session key
+  ngx_queue_t    queue;        // lru list link
+  time_t         expires;      // decision expiration time
+  ngx_uint_t     generation;   // cache generation decision belongs to
+  ngx_uint_t     status;       // route function status, 2xx - allowed
+  u_char         data[1];      // session key, '\0', location name
+} ngx_c2h5oh_auth_node_t;
+
+typedef struct {
+  ngx_rbtree_t      rbtree;    // session key -> ngx_c2h5oh_auth_node_t
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t       queue;     // decisions, most recently used first
+  ngx_uint_t        generation; // older generations decisions are invalid
+} ngx_c2h5oh_auth_sh_t;
+
+typedef struct {
+  ngx_c2h5oh_auth_sh_t * sh;   // shared auth decisions cache
+  ngx_slab_pool_t      * shpool;
+} ngx_c2h5oh_auth_cache_t;
+
+typedef struct {
+  ngx_str_t                name;  // setting name, null terminated
+  ngx_http_complex_value_t value; // setting value
+} ngx_c2h5oh_setting_t;
+
+typedef struct {
+  size_t     cache_size;       // per worker response cache size
+  ngx_int_t  cache_gzip_level; // cached responses gzip level
+  ngx_int_t  connections_max;  // all workers connections limit
+  ngx_shm_zone_t * budget_zone; // shared connections budget
+  size_t     auth_zone_size;   // shared auth decisions cache size, 0 - off
+  ngx_shm_zone_t * auth_zone;  // shared auth decisions cache
+  ngx_str_t  db_path;          // c2h5oh_pass database, pool of all locations
+  size_t     pool_size;        // c2h5oh_pass pool size, 0 - no c2h5oh_pass
+  ngx_int_t  pool_policy;      // c2h5oh_pool parameters
+  ngx_int_t  max_idle_time;    // seconds, 0 - no idle reaping
+  ngx_int_t  min_size;         // adaptive pool min size, 0 - fixed size
+  ngx_int_t  target_wait;      // adaptive pool wait target, ms
+  ngx_int_t  reset;            // session is reset between requests
+  ngx_int_t  shed;             // load shedding wait target, ms, 0 - off
+  ngx_int_t  shed_interval;    // load shedding interval, ms
+} ngx_c2h5oh_main_conf_t;
+
 typedef struct {
   ngx_int_t  enabled;
   ngx_str_t  db_path;
@@ -24,19 +121,48 @@ typedef struct {
   size_t     pool_size;
   ngx_str_t  root;
   ngx_str_t  route;
+  ngx_uint_t methods;
+  ngx_flag_t batch;            // body is json array of route calls
+  ngx_flag_t json_body;        // json body is passed as b argument
+  ngx_flag_t statement_timeout; // c2h5oh_timeout is enforced by database too
+  ngx_int_t  priority;         // connections pool priority class
+  ngx_flag_t hedge;            // slow GET queries are hedged on replica
+  c2h5oh_latency_t * latency;  // location queries latency, drives hedging
+  ngx_flag_t rows;             // function rows are serialized by module
+  ngx_uint_t copy_out;         // COPY TO STDOUT format, 0 - off
+  ngx_str_t  copy_in;          // COPY FROM STDIN statement, empty - off
+  ngx_flag_t upload;           // body is kept as file, route gets metadata
+  ngx_http_complex_value_t * auth_key; // auth decisions cache key, NULL - off
+  ngx_str_t  file_root;        // route envelope files root, empty - off
+  ngx_array_t * map_keys;      // c2h5oh_map routes, ngx_hash_key_t
+  ngx_hash_t    map;           // route -> function
+  ngx_array_t * settings;      // c2h5oh_set, ngx_c2h5oh_setting_t
 } ngx_c2h5oh_loc_conf_t;
 
+//-----------------------------------------------------------------------------
+extern ngx_module_t ngx_c2h5oh_module;
+
 //-----------------------------------------------------------------------------
 // nginx module handlers
 static ngx_int_t ngx_c2h5oh_handler(ngx_http_request_t *r);
 static void ngx_c2h5oh_cleanup(void * data);
 static void ngx_c2h5oh_post_response(ngx_http_request_t * r, 
                                      ngx_c2h5oh_ctx_t * ctx);
+static void ngx_c2h5oh_copy_out(ngx_http_request_t * r, 
+                                ngx_c2h5oh_ctx_t * ctx);
 //-----------------------------------------------------------------------------
 // nginx module config handlers
+static void * ngx_c2h5oh_create_main_conf(ngx_conf_t *cf);
+static char * ngx_c2h5oh_init_main_conf(ngx_conf_t *cf, void *conf);
 static void * ngx_c2h5oh_create_loc_conf(ngx_conf_t *cf);
 static char * ngx_c2h5oh_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static char * ngx_c2h5oh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_c2h5oh_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_c2h5oh_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_c2h5oh_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_c2h5oh_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_c2h5oh_priority_class(ngx_conf_t *cf, ngx_command_t *cmd, 
+                                        void *conf);
 //-----------------------------------------------------------------------------
 #endif //__ngx_c2h5oh_module_h_included__
 // eof
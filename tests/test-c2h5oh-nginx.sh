@@ -30,6 +30,145 @@ res=$(curl -s -POST -d "a=1.2&b=2.6" 'http://localhost:10081/api/sum/'|jq -c '.s
 [ "$res" = '3.8' ] || exit_error
 echo "ok"
 
+echo -n "test  large body ... "
+pad=$(head -c 100000 /dev/zero | tr '\0' 'x')
+res=$(curl -s -POST -d "a=1.2&pad=$pad&b=2.6" 'http://localhost:10081/api/sum/'|jq -c '.sum')
+[ "$res" = '3.8' ] || exit_error
+res=$(curl -s -POST -H 'Transfer-Encoding: chunked' -d "a=1.2&b=2.6" \
+  'http://localhost:10081/api/sum/'|jq -c '.sum')
+[ "$res" = '3.8' ] || exit_error
+echo "ok"
+
+echo -n "test   json body ... "
+res=$(curl -s -POST -H 'Content-Type: application/json' -d '{"a":1.2,"b":"2.6","s":"it'"'"'s"}' \
+  'http://localhost:10081/api/json/sum/'|jq -c '.sum')
+[ "$res" = '3.8' ] || exit_error
+# json body is ignored by routes of locations without c2h5oh_json_body
+res=$(curl -s -o /dev/null -w '%{http_code}' -POST -H 'Content-Type: application/json' \
+  -d '{"a":1}' --cookie 'sid=43' 'http://localhost:10081/auth/session/')
+[ "$res" = '403' ] || exit_error
+echo "ok"
+
+echo -n "test      escape ... "
+res=$(curl -s 'http://localhost:10081/api/echo/?s=a%5Cb%22c%27d%0A%01'|jq -c '.s')
+[ "$res" = '"a\\b\"c'"'"'d\n\u0001"' ] || exit_error
+res=$(curl -s -POST -d 's=a%5Cb\c' 'http://localhost:10081/api/echo/'|jq -c '.s')
+[ "$res" = '"a\\b\\c"' ] || exit_error
+echo "ok"
+
+echo -n "test     methods ... "
+res=$(curl -s -X PUT -H 'Content-Type: application/json' -d '{"a":1}' \
+  'http://localhost:10081/rest/item/'|jq -c '[.method,.body.a]')
+[ "$res" = '["PUT",1]' ] || exit_error
+res=$(curl -s -X DELETE 'http://localhost:10081/rest/item/?id=1'|jq -c '.method')
+[ "$res" = '"DELETE"' ] || exit_error
+len=$(curl -s 'http://localhost:10081/rest/item/'|wc -c)
+res=$(curl -s -I 'http://localhost:10081/rest/item/'|grep 'Content-Length'|$trim)
+[ "$res" = "Content-Length: $len" ] || exit_error
+res=$(curl -i -s -X OPTIONS 'http://localhost:10081/rest/item/'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 405 Not Allowed' ] || exit_error
+res=$(curl -i -s -X PUT 'http://localhost:10081/api/sum/'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 405 Not Allowed' ] || exit_error
+echo "ok"
+
+echo -n "test         map ... "
+res=$(curl -s 'http://localhost:10081/map/sum/?a=1.2&b=2.5'|jq -c '.sum')
+[ "$res" = '3.7' ] || exit_error
+res=$(curl -s 'http://localhost:10081/map/SUM?a=1&b=2'|jq -c '.sum')
+[ "$res" = '3' ] || exit_error
+res=$(curl -s -POST -H 'Content-Type: application/json' -d '{"a":1,"b":2}' \
+  'http://localhost:10081/map/json/sum/'|jq -c '.sum')
+[ "$res" = '3' ] || exit_error
+res=$(curl -s --cookie 'sid=it'"'"'s' 'http://localhost:10081/map/echo/?s=it%27s'|jq -c '.s')
+[ "$res" = '"it'"'"'s"' ] || exit_error
+res=$(curl -i -s 'http://localhost:10081/map/cookie/get/'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 404 Not Found' ] || exit_error
+echo "ok"
+
+echo -n "test       batch ... "
+res=$(curl -s -POST -H 'Content-Type: application/json' \
+  -d '[{"route":"/echo/","args":{"s":"a"}},{"route":"/no/such/"},{"route":"/echo/"}]' \
+  'http://localhost:10081/batch'|jq -c '[.[0].content.s, .[1].status, .[2].content]')
+[ "$res" = '["a",404,{}]' ] || exit_error
+res=$(curl -i -s 'http://localhost:10081/batch'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 405 Not Allowed' ] || exit_error
+echo "ok"
+
+echo -n "test  c2h5oh_set ... "
+res=$(curl -s --cookie 'sid=42' 'http://localhost:10081/map/session/'|jq -c '.sid')
+[ "$res" = '"42"' ] || exit_error
+res=$(curl -s 'http://localhost:10081/map/session/'|jq -c '.sid')
+[ "$res" = '""' ] || exit_error
+echo "ok"
+
+echo -n "test        rows ... "
+res=$(curl -s 'http://localhost:10081/rows/items/?n=2'|jq -c '.')
+[ "$res" = '[{"id":1,"name":"item 1"},{"id":2,"name":"item 2"}]' ] || exit_error
+echo "ok"
+
+echo -n "test      export ... "
+res=$(curl -s 'http://localhost:10081/export/items/?n=2')
+[ "$res" = "$(printf 'id,name\n1,item 1\n2,item 2')" ] || exit_error
+res=$(curl -s 'http://localhost:10081/export/items/?n=100000'|wc -l)
+[ "$res" = "100001" ] || exit_error
+echo "ok"
+
+echo -n "test      import ... "
+res=$(printf '1,a\n2,"b c"\n' | curl -s -H 'Content-Type: text/csv' --data-binary @- \
+  'http://localhost:10081/import/items/'|jq -c '.count')
+[ "$res" = '2' ] || exit_error
+res=$(seq 1 200000 | sed 's/$/,item/' | curl -s -H 'Content-Type: text/csv' \
+  --data-binary @- 'http://localhost:10081/import/items/'|jq -c '.count')
+[ "$res" = '200000' ] || exit_error
+res=$(printf 'x,a\n' | curl -s -o /dev/null -w '%{http_code}' --data-binary @- \
+  'http://localhost:10081/import/items/')
+[ "$res" = '400' ] || exit_error
+echo "ok"
+
+echo -n "test    deadline ... "
+res=$(curl -s 'http://localhost:10081/map/deadline/'|jq -c '.timeout')
+echo "$res" | grep -qE '^"[1-9][0-9]*ms"$' || exit_error
+echo "ok"
+
+echo -n "test   idle pool ... "
+# pool connections except hedge ones
+function conns {
+  psql -q -t -A -d c2h5oh_test__ -c "select count(*) from pg_stat_activity
+    where usename = 'c2h5oh_web__' and application_name <> 'c2h5oh_hedge'"
+}
+res=$(conns)
+[ "$res" -gt 0 ] || exit_error
+# idle connections are closed after max_idle_time
+sleep 3
+res=$(conns)
+[ "$res" = '0' ] || exit_error
+res=$(curl -s 'http://localhost:10081/map/sum/?a=1&b=2'|jq -c '.sum')
+[ "$res" = '3' ] || exit_error
+echo "ok"
+
+echo -n "test       cache ... "
+res=$(curl -s 'http://localhost:10081/api/cached/?a=1'|jq -c '.t')
+[ "$res" ] || exit_error
+[ "$(curl -s 'http://localhost:10081/api/cached/?a=1'|jq -c '.t')" = "$res" ] || exit_error
+[ "$(curl -s 'http://localhost:10081/api/cached/?a=2'|jq -c '.t')" != "$res" ] || exit_error
+enc=$(curl -s -i -H 'Accept-Encoding: gzip' 'http://localhost:10081/api/cached/?a=1'|grep 'Content-Encoding'|$trim)
+[ "$enc" = 'Content-Encoding: gzip' ] || exit_error
+[ "$(curl -s --compressed 'http://localhost:10081/api/cached/?a=1'|jq -c '.t')" = "$res" ] || exit_error
+echo "ok"
+
+echo -n "test        etag ... "
+etag=$(curl -s -i 'http://localhost:10081/api/sum/?a=1&b=2'|grep 'ETag'|cut -d' ' -f2|$trim)
+[ "$etag" ] || exit_error
+res=$(curl -s -i -H "If-None-Match: $etag" 'http://localhost:10081/api/sum/?a=1&b=2'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 304 Not Modified' ] || exit_error
+res=$(curl -s -i -H "If-None-Match: $etag" 'http://localhost:10081/api/sum/?a=1&b=3'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 200 OK' ] || exit_error
+res=$(curl -s -i -H 'If-None-Match: "v1"' 'http://localhost:10081/api/versioned/?v=1'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 304 Not Modified' ] || exit_error
+res=$(curl -s -i -H 'If-None-Match: "v1"' 'http://localhost:10081/api/versioned/?v=2'|head -n1|$trim)
+[ "$res" = 'HTTP/1.1 200 OK' ] || exit_error
+echo "ok"
+
 echo -n "test  cookie_set ... "
 res=$(curl -i -s 'http://localhost:10081/api/cookie/set/?v=777'|grep 'Set-Cookie'|$trim)
 [ "$res" = 'Set-Cookie: sid=777; Domain= .genosse.org; Expires=Fri, 15-Jan-2016 00:00:00 GMT; Path=/; Secure; HttpOnly' ] || exit_error
@@ -57,16 +196,48 @@ res=$(curl -i -s --cookie 'sid=43' 'http://localhost:10081/api/user/auth/'|head
 [ "$res" = 'HTTP/1.1 403 Forbidden' ] || exit_error
 res=$(curl -i -s --cookie 'sid=42' 'http://localhost:10081/api/user/auth/'|head -n1|$trim)
 [ "$res" = 'HTTP/1.1 200 OK' ] || exit_error
+# etag is content length and murmur hash of "OK"
+res=$(curl -i -s --cookie 'sid=42' 'http://localhost:10081/api/user/auth/'|grep 'ETag'|$trim)
+[ "$res" = 'ETag: "2-2d1f4288"' ] || exit_error
 echo "ok"
 
 echo -n "test upload auth ... "
 res=$(curl -POST -d@../../README.md -i -s 'http://localhost:10081/api/upload/'|head -n1|$trim)
 [ "$res" = 'HTTP/1.1 403 Forbidden' ] || exit_error
+[ -z "$(ls uploads)" ] || exit_error
 res=$(curl -s -POST --data-binary @../../README.md -H 'Content-Type: application/octet-stream' \
-  --cookie 'sid=42' 'http://localhost:10081/api/upload/'|jq -r '.name')
-[ "$res" ] || exit_error
-res=$(curl -s "http://localhost:10081/uploads/$res" | md5sum)
+  --cookie 'sid=42' 'http://localhost:10081/api/upload/')
+name=$(echo "$res"|jq -r '.name')
+[ "$name" ] || exit_error
+[ "$(echo "$res"|jq -r '.md5')  -" = "$(cat ../../README.md | md5sum)" ] || exit_error
+[ "$(echo "$res"|jq -r '.size')" = "$(stat -c %s ../../README.md)" ] || exit_error
+res=$(curl -s "http://localhost:10081/uploads/$name" | md5sum)
+[ "$(cat ../../README.md | md5sum)" = "$res" ] || exit_error
+echo "ok"
+
+echo -n "test    download ... "
+url="http://localhost:10081/api/download/?name=$name"
+res=$(curl -s --cookie 'sid=42' "$url" | md5sum)
 [ "$(cat ../../README.md | md5sum)" = "$res" ] || exit_error
+res=$(curl -s -o /dev/null -w '%{http_code} %{size_download}' --cookie 'sid=42' \
+  -H 'Range: bytes=0-9' "$url")
+[ "$res" = '206 10' ] || exit_error
+res=$(curl -s -o /dev/null -w '%{http_code}' --cookie 'sid=42' \
+  "http://localhost:10081/api/download/?name=../c2h5oh.pid")
+[ "$res" = '500' ] || exit_error
+[ "$(curl -s -o /dev/null -w '%{http_code}' "$url")" = '403' ] || exit_error
+echo "ok"
+
+echo -n "test  auth cache ... "
+auth="curl -s -o /dev/null -w %{http_code} http://localhost:10081/auth/session/"
+[ "$($auth --cookie sid=42)" = '200' ] || exit_error
+[ "$($auth --cookie sid=44)" = '403' ] || exit_error
+# decision is answered from cache, login drops decision of its session
+psql -q -d c2h5oh_test__ -c 'insert into web.login values (44)' >/dev/null
+[ "$($auth --cookie sid=44)" = '403' ] || exit_error
+res=$(curl -s 'http://localhost:10081/api/user/login/?token=44'|jq -c '.status')
+[ "$res" = '"ok"' ] || exit_error
+[ "$($auth --cookie sid=44)" = '200' ] || exit_error
 echo "ok"
 
 echo -n "test      logout ... "
@@ -76,6 +247,7 @@ res=$(curl -s 'http://localhost:10081/api/user/logout/'|jq -c '.status')
 [ "$res" = '"ok"' ] || exit_error
 res=$(curl -i -s --cookie 'sid=42' 'http://localhost:10081/api/user/auth/'|head -n1|$trim)
 [ "$res" = 'HTTP/1.1 403 Forbidden' ] || exit_error
+[ "$($auth --cookie sid=42)" = '403' ] || exit_error
 echo "ok"
 
 echo -n "test  large_json ... "
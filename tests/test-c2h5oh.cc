@@ -3,6 +3,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <libpq-fe.h>
+
 #include "c2h5oh.h"
 
 using namespace boost::posix_time;
@@ -54,7 +56,434 @@ BOOST_AUTO_TEST_CASE( test_query )
 
   // cleanup
   c2h5oh_free(c);
-  BOOST_CHECK(c2h5oh_create() != NULL); // check for object reusable
+  BOOST_CHECK((c = c2h5oh_create()) != NULL); // check for object reusable
+  c2h5oh_free(c);
   c2h5oh_module_cleanup();
 }
 
+//-----------------------------------------------------------------------------
+namespace {
+
+std::string args_json(const std::string & args, const std::string & prefix = "")
+{
+  std::string res(prefix.size() + 
+                  c2h5oh_args_json_len(args.data(), args.data() + args.size()), 
+                  '#');
+  std::copy(prefix.begin(), prefix.end(), res.begin());
+  char * end = c2h5oh_args_json(&res[prefix.size()], args.data(), 
+                                args.data() + args.size(), res.data());
+  if (end == NULL) {
+    return "NULL";
+  }
+  BOOST_REQUIRE(end <= res.data() + res.size());
+  res.resize(end - res.data());
+  return res;
+}
+
+// byte by byte reference conversion
+std::string args_json_reference(const std::string & args)
+{
+  auto escape = [](std::string & res, unsigned char c) {
+    char buf[8];
+    if (c == '"' || c == '\\') { res += '\\'; res += c; }
+    else if (c == '\n') res += "\\n";
+    else if (c == '\r') res += "\\r";
+    else if (c == '\t') res += "\\t";
+    else if (c == '\b') res += "\\b";
+    else if (c == '\f') res += "\\f";
+    else if (c < 0x20) { snprintf(buf, sizeof(buf), "\\u%04x", c); res += buf; }
+    else res += c;
+  };
+  std::string res;
+  size_t i = 0;
+  while(i < args.size()) {
+    if (!res.empty()) res += ',';
+    res += '"';
+    while(i < args.size() && (args[i] == '=' || args[i] == '&')) i++;
+    while(i < args.size() && args[i] != '=' && args[i] != '&') escape(res, args[i++]);
+    res += "\":\"";
+    if (i < args.size() && args[i] == '=') {
+      i++;
+      while(i < args.size() && args[i] != '=' && args[i] != '&') {
+        if (args[i] == '%') {
+          if (i + 2 >= args.size() || !isxdigit(args[i + 1]) || 
+              !isxdigit(args[i + 2])) return "NULL";
+          escape(res, std::stoi(args.substr(i + 1, 2), nullptr, 16));
+          i += 3;
+        } else if (args[i] == '+') {
+          res += ' '; i++;
+        } else {
+          escape(res, args[i++]);
+        }
+      }
+    } else if (i < args.size()) {
+      i++;
+    }
+    res += '"';
+  }
+  return res;
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_args_json )
+{
+  // same output as byte by byte parser
+  BOOST_CHECK_EQUAL(args_json(""), "");
+  BOOST_CHECK_EQUAL(args_json("a=1.2&b=2.5"), "\"a\":\"1.2\",\"b\":\"2.5\"");
+  BOOST_CHECK_EQUAL(args_json("a"), "\"a\":\"\"");
+  BOOST_CHECK_EQUAL(args_json("a&b=1"), "\"a\":\"\",\"b\":\"1\"");
+  BOOST_CHECK_EQUAL(args_json("a=1&"), "\"a\":\"1\",\"\":\"\"");
+  BOOST_CHECK_EQUAL(args_json("u=http%3A%2F%2Fgenosse.org%2F"), 
+                    "\"u\":\"http://genosse.org/\"");
+  BOOST_CHECK_EQUAL(args_json("s=a+b"), "\"s\":\"a b\"");
+  BOOST_CHECK_EQUAL(args_json("s=it's"), "\"s\":\"it's\"");
+  BOOST_CHECK_EQUAL(args_json("s=%22q%22"), "\"s\":\"\\\"q\\\"\"");
+  BOOST_CHECK_EQUAL(args_json("a=1", "{\"b\":\"2\""), 
+                    "{\"b\":\"2\",\"a\":\"1\"");
+
+  // lowercase escapes, full json escaping
+  BOOST_CHECK_EQUAL(args_json("s=%2f%2F"), "\"s\":\"//\"");
+  BOOST_CHECK_EQUAL(args_json("s=a%5Cb\\c"), "\"s\":\"a\\\\b\\\\c\"");
+  BOOST_CHECK_EQUAL(args_json("s=%0A%09%01%1f"), "\"s\":\"\\n\\t\\u0001\\u001f\"");
+  BOOST_CHECK_EQUAL(args_json("k\"\\=v"), "\"k\\\"\\\\\":\"v\"");
+
+  // wrong escape sequences
+  BOOST_CHECK_EQUAL(args_json("s=%"), "NULL");
+  BOOST_CHECK_EQUAL(args_json("s=%4"), "NULL");
+  BOOST_CHECK_EQUAL(args_json("s=%zz"), "NULL");
+  BOOST_CHECK_EQUAL(args_json("s=%4=1"), "NULL");
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_args_json_long )
+{
+  // special characters at every position of vectorized blocks
+  const char specials[] = "=&%+\"\\'\n\x01";
+  std::string plain = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  plain += plain;
+  for(size_t len = 1; len < 80; len++) {
+    for(size_t pos = 0; pos < len; pos++) {
+      for(const char * s = specials; *s; s++) {
+        std::string args = "key=" + plain.substr(0, len);
+        args[4 + pos] = *s;
+        if (*s == '%') args.insert(4 + pos + 1, "7e");
+        BOOST_REQUIRE_EQUAL(args_json(args), args_json_reference(args));
+      }
+    }
+  }
+
+  // random input
+  srand(42);
+  const char alphabet[] = "abc=&%+\"\\'\n\x01\x7f\xd0\xb0 0123456789ABCDEF";
+  for(int i = 0; i < 10000; i++) {
+    std::string args(rand() % 100, ' ');
+    for(auto & c : args) c = alphabet[rand() % (sizeof(alphabet) - 1)];
+    BOOST_REQUIRE_EQUAL(args_json(args), args_json_reference(args));
+  }
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_cache )
+{
+  c2h5oh_cache_init(1000, 6);
+  size_t len;
+
+  // put, get and expire
+  BOOST_REQUIRE(c2h5oh_cache_put("k1", 2, "{\"content\":1}", 13, 100) != NULL);
+  BOOST_CHECK(c2h5oh_cache_get("k", 1, 10) == NULL);
+  auto e = c2h5oh_cache_get("k1", 2, 10);
+  BOOST_REQUIRE(e != NULL);
+  const char * res = c2h5oh_cache_result(e, &len);
+  BOOST_CHECK_EQUAL(std::string(res, len), "{\"content\":1}");
+  BOOST_CHECK(c2h5oh_cache_get("k1", 2, 100) == NULL);
+  BOOST_CHECK(c2h5oh_cache_get("k1", 2, 10) == NULL);
+
+  // too large result is not cached
+  std::string large(1000, 'x');
+  BOOST_CHECK(c2h5oh_cache_put("k2", 2, large.data(), large.size(), 100) == NULL);
+
+  // least recently used entry is removed
+  std::string v(300, 'v');
+  BOOST_REQUIRE(c2h5oh_cache_put("a", 1, v.data(), v.size(), 100) != NULL);
+  BOOST_REQUIRE(c2h5oh_cache_put("b", 1, v.data(), v.size(), 100) != NULL);
+  BOOST_REQUIRE(c2h5oh_cache_put("c", 1, v.data(), v.size(), 100) != NULL);
+  BOOST_REQUIRE(c2h5oh_cache_get("a", 1, 10) != NULL);
+  BOOST_REQUIRE(c2h5oh_cache_put("d", 1, v.data(), v.size(), 100) != NULL);
+  BOOST_CHECK(c2h5oh_cache_get("a", 1, 10) != NULL);
+  BOOST_CHECK(c2h5oh_cache_get("b", 1, 10) == NULL);
+  BOOST_CHECK(c2h5oh_cache_get("c", 1, 10) != NULL);
+  BOOST_CHECK(c2h5oh_cache_get("d", 1, 10) != NULL);
+
+  // content is compressed once, uncompressible content is not stored
+  e = c2h5oh_cache_get("a", 1, 10);
+  BOOST_REQUIRE(e != NULL);
+  const char * gz = c2h5oh_cache_gzip(e, v.data(), v.size(), &len);
+  BOOST_REQUIRE(gz != NULL);
+  BOOST_CHECK(len < v.size() && (unsigned char)gz[0] == 0x1f);
+  BOOST_CHECK(c2h5oh_cache_gzip(e, "other", 5, &len) == gz);
+  e = c2h5oh_cache_get("c", 1, 10);
+  BOOST_CHECK(c2h5oh_cache_gzip(e, "ab", 2, &len) == NULL);
+
+  c2h5oh_cache_init(0, 6);
+  BOOST_CHECK(c2h5oh_cache_get("a", 1, 10) == NULL);
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_pool_size )
+{
+  c2h5oh_module_set_pool_size(1, 5);
+  BOOST_REQUIRE(c2h5oh_module_init(kConnString, strlen(kConnString), 3) == 0);
+
+  // pool starts with min size
+  auto a = c2h5oh_create();
+  BOOST_REQUIRE(a != NULL);
+  BOOST_CHECK(c2h5oh_create() == NULL);
+
+  // short waits don't grow the pool
+  c2h5oh_report_wait(1, 1);
+  BOOST_CHECK(c2h5oh_create() == NULL);
+
+  // long waits grow the pool up to max size
+  auto b = (c2h5oh_t *)NULL;
+  for(int i = 0; i < 100 && b == NULL; i++) {
+    c2h5oh_report_wait(100, 1);
+    b = c2h5oh_create();
+  }
+  BOOST_REQUIRE(b != NULL);
+  auto c = (c2h5oh_t *)NULL;
+  for(int i = 0; i < 100 && c == NULL; i++) {
+    c2h5oh_report_wait(100, 1);
+    c = c2h5oh_create();
+  }
+  BOOST_REQUIRE(c != NULL);
+  c2h5oh_report_wait(100, 1);
+  BOOST_CHECK(c2h5oh_create() == NULL);
+
+  // idle connections shrink the pool down to min size
+  c2h5oh_free(a);
+  c2h5oh_free(b);
+  c2h5oh_free(c);
+  c2h5oh_maintain(time(NULL) + 3600);
+  a = c2h5oh_create();
+  BOOST_REQUIRE(a != NULL);
+  BOOST_CHECK(c2h5oh_create() == NULL);
+  c2h5oh_free(a);
+
+  c2h5oh_module_cleanup();
+  c2h5oh_module_set_pool_size(0, 0);
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_pool_budget )
+{
+  c2h5oh_module_set_pool_size(1, 5);
+  BOOST_REQUIRE(c2h5oh_module_init(kConnString, strlen(kConnString), 3) == 0);
+
+  // pool min size is counted in budget
+  c2h5oh_budget_t budget = {};
+  budget.max = 2;
+  c2h5oh_module_set_budget(&budget, 1);
+  BOOST_CHECK_EQUAL(budget.count, 1);
+  BOOST_CHECK_EQUAL(budget.used[1], 1);
+
+  // pool grows while budget allows
+  auto a = c2h5oh_create();
+  BOOST_REQUIRE(a != NULL);
+  auto b = (c2h5oh_t *)NULL;
+  for(int i = 0; i < 100 && b == NULL; i++) {
+    c2h5oh_report_wait(100, 1);
+    b = c2h5oh_create();
+  }
+  BOOST_REQUIRE(b != NULL);
+  BOOST_CHECK_EQUAL(budget.count, 2);
+  for(int i = 0; i < 100; i++) {
+    c2h5oh_report_wait(100, 1);
+  }
+  BOOST_CHECK(c2h5oh_create() == NULL);
+  BOOST_CHECK_EQUAL(budget.count, 2);
+
+  // shrinked pool and cleanup return connections to budget
+  c2h5oh_free(a);
+  c2h5oh_free(b);
+  c2h5oh_maintain(time(NULL) + 3600);
+  BOOST_CHECK_EQUAL(budget.count, 1);
+  c2h5oh_module_cleanup();
+  BOOST_CHECK_EQUAL(budget.count, 0);
+
+  // connections of process died in the slot are returned to budget
+  budget.count   = 2;
+  budget.used[1] = 2;
+  BOOST_REQUIRE(c2h5oh_module_init(kConnString, strlen(kConnString), 3) == 0);
+  c2h5oh_module_set_budget(&budget, 1);
+  BOOST_CHECK_EQUAL(budget.count, 1);
+  BOOST_CHECK_EQUAL(budget.used[1], 1);
+  c2h5oh_module_cleanup();
+  BOOST_CHECK_EQUAL(budget.count, 0);
+  c2h5oh_module_set_pool_size(0, 0);
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_pool_classes )
+{
+  BOOST_REQUIRE(c2h5oh_module_init(kConnString, strlen(kConnString), 4) == 0);
+
+  // reserved connection is not given to other class
+  c2h5oh_module_set_class(1, 1, 1);
+  c2h5oh_t * c[4];
+  for(int i = 0; i < 3; i++) {
+    BOOST_REQUIRE((c[i] = c2h5oh_create()) != NULL);
+  }
+  BOOST_CHECK(c2h5oh_create() == NULL);
+  BOOST_REQUIRE((c[3] = c2h5oh_create_class(1)) != NULL);
+  for(int i = 0; i < 4; i++) {
+    c2h5oh_free(c[i]);
+  }
+
+  // waiting classes are served in proportion to weights
+  c2h5oh_module_set_class(1, 0, 3);
+  c2h5oh_wait_class(0, 1);
+  c2h5oh_wait_class(1, 1);
+  int served[2] = { 0, 0 };
+  for(int i = 0; i < 60; i++) {
+    for(int k = 0; k < 2; k++) {
+      auto a = c2h5oh_create_class(k);
+      if (a != NULL) {
+        served[k]++;
+        c2h5oh_free(a);
+      }
+    }
+  }
+  BOOST_CHECK(served[1] >= served[0] * 3 - 3 && served[1] <= served[0] * 3 + 3);
+  c2h5oh_wait_class(0, 0);
+  c2h5oh_wait_class(1, 0);
+
+  // class without waiters doesn't hold others
+  BOOST_REQUIRE((c[0] = c2h5oh_create()) != NULL);
+  BOOST_REQUIRE((c[1] = c2h5oh_create()) != NULL);
+  c2h5oh_free(c[0]);
+  c2h5oh_free(c[1]);
+
+  c2h5oh_module_set_class(1, 0, 1);
+  c2h5oh_module_cleanup();
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_shed )
+{
+  c2h5oh_module_set_shed(5, 20);
+
+  // queue is not overloaded until no request is served quickly for interval
+  c2h5oh_wait_class(0, 1);
+  BOOST_CHECK(c2h5oh_shed(10) == 0);
+  usleep(30000);
+  BOOST_CHECK(c2h5oh_shed(10) == 1);
+  BOOST_CHECK(c2h5oh_shed(3) == 0);
+
+  // burst being drained is not overloaded, request served in interval
+  // waited less than target
+  c2h5oh_report_wait(2, 1);
+  c2h5oh_report_wait(50, 1);
+  usleep(30000);
+  BOOST_CHECK(c2h5oh_shed(10) == 0);
+
+  // standing queue, the least wait of interval exceeds target
+  c2h5oh_report_wait(8, 1);
+  usleep(30000);
+  BOOST_CHECK(c2h5oh_shed(10) == 1);
+
+  // saturated pool, newcomers which took connection at once don't hide
+  // standing queue
+  for(int i = 0; i < 10; i++) {
+    c2h5oh_report_wait(0, 0);
+  }
+  c2h5oh_report_wait(8, 1);
+  usleep(30000);
+  BOOST_CHECK(c2h5oh_shed(10) == 1);
+  c2h5oh_report_wait(0, 0);
+  usleep(30000);
+  BOOST_CHECK(c2h5oh_shed(10) == 1);
+
+  // empty queue is not overloaded
+  c2h5oh_wait_class(0, 0);
+  BOOST_CHECK(c2h5oh_shed(10) == 0);
+  c2h5oh_wait_class(0, 1);
+  BOOST_CHECK(c2h5oh_shed(10) == 0);
+  c2h5oh_wait_class(0, 0);
+
+  c2h5oh_module_set_shed(0, 0);
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_hedge )
+{
+  c2h5oh_latency_t l = {};
+  l.percentile = 90;
+
+  // no hedging without replica pool
+  BOOST_CHECK(c2h5oh_create_hedge() == NULL);
+  BOOST_CHECK_EQUAL(c2h5oh_hedge_delay(&l), 0);
+
+  BOOST_REQUIRE(c2h5oh_module_init_hedge(kConnString, strlen(kConnString), 
+                                         1) == 0);
+  auto c = c2h5oh_create_hedge();
+  BOOST_REQUIRE(c != NULL);
+  BOOST_CHECK(c2h5oh_create_hedge() == NULL); // check for pool size 1
+  c2h5oh_free(c);
+
+  // delay is latency percentile of recent queries
+  BOOST_CHECK_EQUAL(c2h5oh_hedge_delay(&l), 0);
+  for(unsigned i = 0; i < 200; i++) {
+    c2h5oh_report_latency(&l, i % 100 + 1);
+  }
+  BOOST_CHECK(c2h5oh_hedge_delay(&l) >= 85 && c2h5oh_hedge_delay(&l) <= 95);
+
+  // other group latency is its own
+  c2h5oh_latency_t fast = {};
+  fast.percentile = 90;
+  for(unsigned i = 0; i < 200; i++) {
+    c2h5oh_report_latency(&fast, 2);
+  }
+  BOOST_CHECK_EQUAL(c2h5oh_hedge_delay(&fast), 2);
+  BOOST_CHECK(c2h5oh_hedge_delay(&l) >= 85);
+
+  c2h5oh_module_cleanup();
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_drain )
+{
+  BOOST_REQUIRE(c2h5oh_module_init(kConnString, strlen(kConnString), 1) == 0);
+
+  // free connection while query is in progress
+  auto c = c2h5oh_create();
+  BOOST_REQUIRE(c != NULL);
+  BOOST_REQUIRE(c2h5oh_query(c, "select pg_sleep(1000.1);") == 0);
+  ptime time_end = microsec_clock::local_time() + millisec(50);
+  while(c2h5oh_poll(c) == 0 && time_end > microsec_clock::local_time()) usleep(1);
+  c2h5oh_free(c);
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  // connection is not available until canceled query is drained
+  BOOST_CHECK(c2h5oh_create() == NULL);
+#else
+  // connection is closed instead of blocking cancel, returned at once
+  BOOST_CHECK_EQUAL(c2h5oh_drain(time(NULL)), 0);
+#endif//LIBPQ_HAS_ASYNC_CANCEL
+  time_end = microsec_clock::local_time() + seconds(1);
+  while(c2h5oh_drain(time(NULL)) > 0 && time_end > microsec_clock::local_time()) {
+    usleep(1);
+  }
+  BOOST_CHECK_EQUAL(c2h5oh_drain(time(NULL)), 0);
+
+  // drained connection is reused
+  BOOST_REQUIRE((c = c2h5oh_create()) != NULL);
+  BOOST_REQUIRE(c2h5oh_query(c, "select 1;") == 0);
+  time_end = microsec_clock::local_time() + seconds(1);
+  while(c2h5oh_poll(c) == 0 && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(c2h5oh_is_error(c) == 0 && std::string(c2h5oh_result(c)) == "1");
+
+  c2h5oh_free(c);
+  c2h5oh_module_cleanup();
+}
@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE test_object_pool
+#include <boost/test/unit_test.hpp>
+#include <set>
+#include <vector>
+
+#include "object_pool.h"
+
+//-----------------------------------------------------------------------------
+namespace {
+
+struct Counted {
+  static int count;
+  Counted()  { count++; }
+  ~Counted() { count--; }
+  int value = 0;
+};
+int Counted::count = 0;
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_object_pool )
+{
+  object_pool<Counted> pool;
+  BOOST_CHECK_EQUAL(Counted::count, 0); // nothing is allocated until sized
+  BOOST_CHECK(pool.object_new() == nullptr);
+  BOOST_CHECK(pool.set_max_size(4));
+  BOOST_CHECK_EQUAL(Counted::count, 4);
+  BOOST_CHECK_EQUAL(pool.get_max_size(), 4);
+
+  // all objects are different and cache line aligned
+  std::set<Counted *> objects;
+  Counted * o;
+  while((o = pool.object_new()) != nullptr) {
+    BOOST_CHECK_EQUAL((size_t)o % 64, 0);
+    objects.insert(o);
+  }
+  BOOST_CHECK_EQUAL(objects.size(), 4);
+  BOOST_CHECK_EQUAL(pool.used_count(), 4);
+
+  // last freed object is returned first
+  Counted * a = *objects.begin();
+  Counted * b = *objects.rbegin();
+  a->value = 42;
+  pool.object_delete(a);
+  pool.object_delete(b);
+  BOOST_CHECK(pool.object_new() == b);
+  BOOST_CHECK(pool.object_new() == a);
+  BOOST_CHECK_EQUAL(a->value, 42); // objects are not reconstructed
+  BOOST_CHECK(pool.object_new() == nullptr);
+
+  // pool isn't resized while objects are in use
+  BOOST_CHECK(!pool.set_max_size(2));
+  BOOST_CHECK_EQUAL(pool.get_max_size(), 4);
+
+  for(auto p : objects) {
+    pool.object_delete(p);
+  }
+  BOOST_CHECK_EQUAL(pool.used_count(), 0);
+
+  // resize reconstructs objects
+  pool.set_max_size(2);
+  BOOST_CHECK_EQUAL(Counted::count, 2);
+  pool.set_max_size(0);
+  BOOST_CHECK_EQUAL(Counted::count, 0);
+  BOOST_CHECK(pool.object_new() == nullptr);
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_object_pool_policy )
+{
+  object_pool<Counted> pool;
+  pool.set_max_size(3);
+  Counted * a = pool.object_new();
+  Counted * b = pool.object_new();
+  Counted * c = pool.object_new();
+
+  // lifo: most recently freed first
+  pool.object_delete(a);
+  pool.object_delete(b);
+  BOOST_CHECK(pool.object_new() == b);
+  BOOST_CHECK(pool.object_new() == a);
+
+  // fifo: least recently freed first, objects are used in turn
+  pool.set_policy(pool_policy::FIFO);
+  pool.object_delete(a);
+  pool.object_delete(b);
+  pool.object_delete(c);
+  for(int i = 0; i < 3; i++) {
+    Counted * o = pool.object_new();
+    BOOST_CHECK(o == (i == 0 ? a : i == 1 ? b : c));
+    pool.object_delete(o);
+  }
+
+  // free objects are visited in selection order
+  std::vector<Counted *> free;
+  pool.for_each_free([&free](Counted & o) { free.push_back(&o); });
+  BOOST_CHECK(free == std::vector<Counted *>({ a, b, c }));
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_object_pool_limit )
+{
+  object_pool<Counted> pool;
+  pool.set_max_size(3);
+  BOOST_CHECK_EQUAL(pool.get_limit(), 3);
+
+  // objects over limit are not returned
+  pool.set_limit(1);
+  Counted * a = pool.object_new();
+  BOOST_CHECK(a != nullptr);
+  BOOST_CHECK(pool.object_new() == nullptr);
+
+  // limit grows up to max size
+  pool.set_limit(5);
+  BOOST_CHECK_EQUAL(pool.get_limit(), 3);
+  Counted * b = pool.object_new();
+  Counted * c = pool.object_new();
+  BOOST_CHECK(b != nullptr && c != nullptr);
+
+  // lowered limit applies to next object_new
+  pool.set_limit(2);
+  pool.object_delete(c);
+  BOOST_CHECK(pool.object_new() == nullptr);
+  pool.object_delete(b);
+  BOOST_CHECK(pool.object_new() == b);
+  pool.object_delete(a);
+  pool.object_delete(b);
+}
@@ -33,6 +33,290 @@ BOOST_AUTO_TEST_CASE( test_query )
   if (db.result_is_error()) BOOST_ERROR(db.get_result());
 }
 
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_query_params )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // text parameter and binary json parameter without null terminator
+  const char json[] = "{\"a\" : 1, \"b\" : 2}garbage";
+  const char * values[]  = { "5", json };
+  const int    lengths[] = { 0, sizeof("{\"a\" : 1, \"b\" : 2}") - 1 };
+  const int    formats[] = { 0, 1 };
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  db.do_query("select $1::int + (pq_test.pq_test($2::json::jsonb)->>'sum')::int;", 
+              2, values, lengths, formats);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "8");
+  if (db.result_is_error()) BOOST_ERROR(db.get_result());
+
+  // plain query after parameterized one
+  db.do_query("select pq_test.pq_test('{\"a\" : 1, \"b\" : 2}');");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "{\"sum\" : 3}");
+  if (db.result_is_error()) BOOST_ERROR(db.get_result());
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_query_prepared )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // statement is prepared on first call and reused by the next ones
+  const char * query = "select $1::int + $2::int;";
+  const char * values[][2] = { { "1", "2" }, { "3", "4" } };
+  const char * results[] = { "3", "7" };
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  for(int i = 0; i < 2; i++) {
+    db.do_query(query, 2, values[i], nullptr, nullptr, true);
+    while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+    BOOST_CHECK(db.has_result() && db.get_result() == results[i]);
+    if (db.result_is_error()) BOOST_ERROR(db.get_result());
+  }
+
+  // prepare error is returned as query error
+  db.do_query("select pq_test.no_such_function($1::int);", 1, values[0],
+              nullptr, nullptr, true);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.result_is_error() && db.get_result().find("42883") == 0);
+
+  // statements are prepared again after reconnect
+  BOOST_REQUIRE(db.connect(kConnStr));
+  db.do_query(query, 2, values[1], nullptr, nullptr, true);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "7");
+  if (db.result_is_error()) BOOST_ERROR(db.get_result());
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_reset_session )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // session setting is kept without reset
+  const char * values[] = { "c2h5oh.test" };
+  const char * get = "select current_setting($1::text, true);";
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  db.do_query("select set_config('c2h5oh.test', 'x', false);");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  db.do_query(get, 1, values, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "x");
+
+  // reset is pipelined with parameterized and prepared queries
+  for(int prepared = 0; prepared < 2; prepared++) {
+    db.do_query("select set_config('c2h5oh.test', 'x', false);");
+    while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+    db.reset_session();
+    db.do_query(get, 1, values, nullptr, nullptr, prepared);
+    while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+    BOOST_CHECK(db.has_result() && db.get_result() == "");
+    if (db.result_is_error()) BOOST_ERROR(db.get_result());
+  }
+
+  // reset is sent before query without parameters
+  db.do_query("select set_config('c2h5oh.test', 'x', false);");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  db.reset_session();
+  db.do_query("select current_setting('c2h5oh.test', true);");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "");
+  if (db.result_is_error()) BOOST_ERROR(db.get_result());
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_preamble )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // preamble setting is local to query transaction
+  const char * settings[] = { "c2h5oh.test", "y" };
+  const char * values[] = { "c2h5oh.test" };
+  const char * get = "select current_setting($1::text, true);";
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  for(int prepared = 0; prepared < 2; prepared++) {
+    db.set_preamble("select set_config($1, $2, true);", 2, settings, nullptr);
+    db.do_query(get, 1, values, nullptr, nullptr, prepared);
+    while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+    BOOST_CHECK(db.has_result() && db.get_result() == "y");
+    if (db.result_is_error()) BOOST_ERROR(db.get_result());
+  }
+  db.abort();
+  db.do_query(get, 1, values, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "");
+
+  // preamble error is returned as query error
+  db.set_preamble("select 1/0;", 0, nullptr, nullptr);
+  db.do_query(get, 1, values, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.result_is_error() && db.get_result().find("22012") == 0);
+  db.abort();
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_batch )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // queries are executed in own transactions, error is returned as item
+  const char * values[] = { "1", "2", "3", "4", "x", "1" };
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  for(int prepared = 0; prepared < 3; prepared++) {
+    db.do_batch("select $1::int + $2::int;", 3, 2, values, nullptr, nullptr,
+                prepared > 0);
+    while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+    BOOST_CHECK(db.has_result() && !db.result_is_error());
+    BOOST_CHECK(db.get_result().find("[3,7,{\"status\":500,\"error\":\"22P02_")
+                == 0);
+  }
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_rows )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // values are encoded by column type
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  db.set_rows(true);
+  db.do_query("select i as a, 'x\"' || i as b, null::int as c, i > 1 as d, "
+              "'NaN'::float8 as e, 1.5::numeric as f, '{\"k\":1}'::jsonb as g "
+              "from generate_series(1, 2) i;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == 
+    "[{\"a\":1,\"b\":\"x\\\"1\",\"c\":null,\"d\":false,\"e\":\"NaN\","
+    "\"f\":1.5,\"g\":{\"k\": 1}},"
+    "{\"a\":2,\"b\":\"x\\\"2\",\"c\":null,\"d\":true,\"e\":\"NaN\","
+    "\"f\":1.5,\"g\":{\"k\": 1}}]");
+  if (db.result_is_error()) BOOST_ERROR(db.get_result());
+
+  // no rows is empty array, abort returns first value again
+  db.do_query("select 1 where false;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "[]");
+  db.abort();
+  db.do_query("select 1;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "1");
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_copy )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // parameters are quoted literals, rows are read until copy is done
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  const char * values[] = { "x'" };
+  db.do_copy("copy (select i, $1 || i from generate_series(1, 3) i) "
+             "to stdout (format csv);", 1, values, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_REQUIRE(db.is_copy());
+  std::string data;
+  const char * row;
+  int len;
+  while((len = db.get_copy_data(&row)) >= 0 &&
+        time_end > microsec_clock::local_time())
+  {
+    data.append(row, len);
+    usleep(1);
+  }
+  BOOST_CHECK(data == "1,x'1\n2,x'2\n3,x'3\n");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(!db.is_copy() && !db.result_is_error());
+
+  // $n in literals, quoted identifiers and comments is not a parameter
+  db.do_copy("copy (select '$1', $1 /* $1 */, $$ $1 $$, $t$'$1$t$ \"$1\") "
+             "to stdout (format csv); -- $1", 1, values, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_REQUIRE(db.is_copy());
+  data.clear();
+  while((len = db.get_copy_data(&row)) >= 0 &&
+        time_end > microsec_clock::local_time())
+  {
+    data.append(row, len);
+    usleep(1);
+  }
+  BOOST_CHECK(data == "$1,x', $1 ,'$1\n");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(!db.is_copy() && !db.result_is_error());
+
+  // parameter which can't be escaped (incomplete character) is query error
+  const char * invalid[] = { "\xe2" };
+  db.do_copy("copy (select $1) to stdout;", 1, invalid, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(!db.is_copy() && db.result_is_error() && 
+              db.get_result().size() > 0);
+
+  // copy error is query result
+  db.do_copy("copy (select 1/0) to stdout;", 0, nullptr, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  while(db.is_copy() && db.get_copy_data(&row) >= 0) usleep(1);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.result_is_error());
+
+  // aborted copy drops connection, next query reconnects
+  db.do_copy("copy (select generate_series(1, 1000000)) to stdout;",
+             0, nullptr, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  db.abort();
+  db.do_query("select 1;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "1");
+}
+
+//-----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( test_copy_in )
+{
+  // create database and connect
+  PqAsync db;
+  BOOST_REQUIRE(db.connect(kConnStr));
+
+  // data is sent by chunks, row may span chunks
+  ptime time_end = microsec_clock::local_time() + seconds(1);
+  db.do_query("delete from pq_test.t;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  db.do_copy("copy pq_test.t (id, val) from stdin (format csv);",
+             0, nullptr, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_REQUIRE(db.is_copy());
+  const char * chunks[] = { "1,10\n2,", "20\n3,30\n" };
+  for(const char * chunk : chunks) {
+    while(db.put_copy_data(chunk, strlen(chunk)) == 0) usleep(1);
+  }
+  while(db.put_copy_end() == 0) usleep(1);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(!db.result_is_error());
+  db.do_query("select sum(val) from pq_test.t;");
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.has_result() && db.get_result() == "60");
+
+  // malformed data is copy error
+  db.do_copy("copy pq_test.t (id, val) from stdin (format csv);",
+             0, nullptr, nullptr, nullptr);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_REQUIRE(db.is_copy());
+  while(db.put_copy_data("x,1\n", 4) == 0) usleep(1);
+  while(db.put_copy_end() == 0) usleep(1);
+  while(db.poll() && time_end > microsec_clock::local_time()) usleep(1);
+  BOOST_CHECK(db.result_is_error());
+}
+
 //-----------------------------------------------------------------------------
 BOOST_AUTO_TEST_CASE( test_sleep )
 {